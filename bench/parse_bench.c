@@ -0,0 +1,206 @@
+/**
+ * Microbenchmark for the command line parser (run with 'make bench')
+ *
+ * Compares parse_line() of wish.c with the strtok-based parser it replaced,
+ * over a fixed, generated batch of lines with parallel commands and
+ * redirections. Both parsers get a fresh copy of each line, and each run
+ * releases its memory the way the shell does, so only parsing is measured.
+ */
+
+// Pull in the shell itself, renaming its entry point
+#define main wish_main
+#include "../wish.c"
+#undef main
+
+#define BENCH_LINES 200000        // Lines in the generated batch
+#define BENCH_RUNS 5              // Runs per parser; the best one is reported
+#define LEGACY_TOKENS_NUMBER 64   // Token limit of the old parser
+
+/**
+ * Splits tokens around an embedded operator (the parser before the scanner)
+ * @param tokens Array of initial tokens
+ * @param token_count Pointer to the number of tokens (updated)
+ * @param delimiter The operator to split around ('>' or '&')
+ * @return New array of tokens
+ */
+char **legacy_parse_subtokens(char **tokens, int *token_count, char *delimiter)
+{
+    char **parsed_tokens = malloc(LEGACY_TOKENS_NUMBER * (sizeof(char *)));
+    int parsed_count = 0;
+    char *subtoken;
+
+    for (int i = 0; i < *token_count; i++)
+    {
+        if (!strcmp(tokens[i], delimiter))
+        {
+            parsed_tokens[parsed_count++] = tokens[i];
+            parsed_tokens[parsed_count] = NULL;
+            continue;
+        }
+
+        char *token_copy = malloc(strlen(tokens[i]) + 1);
+        strcpy(token_copy, tokens[i]);
+
+        subtoken = strtok(tokens[i], delimiter);
+        if (!strcmp(subtoken, token_copy))
+        {
+            parsed_tokens[parsed_count++] = tokens[i];
+            parsed_tokens[parsed_count] = NULL;
+            free(token_copy);
+            continue;
+        }
+        free(token_copy);
+
+        do
+        {
+            parsed_tokens[parsed_count++] = subtoken;
+            parsed_tokens[parsed_count++] = delimiter;
+            subtoken = strtok(NULL, delimiter);
+        } while (subtoken != NULL);
+        parsed_tokens[--parsed_count] = NULL;
+    }
+
+    *token_count = parsed_count;
+    return parsed_tokens;
+}
+
+/**
+ * Parses a line with strtok and two parse_subtokens() passes (the parser
+ * before the scanner)
+ * @param line The line (modified in place)
+ * @return Array of tokens; the caller frees it
+ */
+char **legacy_parse_line(char *line)
+{
+    char **initial_tokens = malloc(LEGACY_TOKENS_NUMBER * (sizeof(char *)));
+    int token_count = 0;
+
+    char *token = strtok(line, DELIM);
+    while (token != NULL && token_count < LEGACY_TOKENS_NUMBER - 1)
+    {
+        initial_tokens[token_count++] = token;
+        token = strtok(NULL, DELIM);
+    }
+    initial_tokens[token_count] = NULL;
+
+    char **redirection_parsed = legacy_parse_subtokens(initial_tokens, &token_count, REDIRECTION_DELIM);
+    char **final_tokens = legacy_parse_subtokens(redirection_parsed, &token_count, PARALLEL_DELIM);
+    free(initial_tokens);
+
+    // The old shell leaked this array; freeing it keeps memory bounded
+    free(redirection_parsed);
+    return final_tokens;
+}
+
+/**
+ * Generates the batch: 1-4 '&'-separated commands per line, some with
+ * output redirections, with and without spaces around the operators
+ * @param size Set to the size of the batch in bytes
+ * @return Array of BENCH_LINES lines
+ */
+char **generate_lines(size_t *size)
+{
+    static const char *commands[] = {
+        "ls -la /tmp", "echo hello world", "cat notes.txt", "grep -n pattern src/main.c",
+        "sort -r data.csv", "wc -l", "find . -name build", "head -n 20 access.log",
+    };
+    static const char *targets[] = {"out.txt", "log/run.log", "result"};
+    char **lines = malloc(BENCH_LINES * sizeof(char *));
+    unsigned int seed = 12345;
+    *size = 0;
+
+    for (size_t i = 0; i < BENCH_LINES; i++)
+    {
+        char line[512];
+        size_t length = 0;
+        seed = seed * 1103515245 + 12345;
+        int command_count = 1 + (int)(seed >> 16) % 4;
+
+        for (int j = 0; j < command_count; j++)
+        {
+            seed = seed * 1103515245 + 12345;
+            unsigned int choice = seed >> 16;
+            length += sprintf(line + length, "%s%s", j == 0 ? "" : (choice & 1) ? " & " : "&",
+                              commands[choice % 8]);
+            if (choice & 2)
+            {
+                length += sprintf(line + length, "%s%s", (choice & 4) ? " > " : ">", targets[choice % 3]);
+            }
+        }
+        line[length++] = '\n';
+        line[length] = '\0';
+
+        lines[i] = strdup(line);
+        *size += length;
+    }
+    return lines;
+}
+
+/**
+ * Parses every line once with one of the parsers
+ * @param lines The batch
+ * @param legacy Whether to use the old parser
+ * @return Elapsed time in seconds
+ */
+double run_parser(char **lines, bool legacy)
+{
+    char copy[512];
+    struct timespec start;
+    struct timespec end;
+    size_t token_total = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < BENCH_LINES; i++)
+    {
+        strcpy(copy, lines[i]);
+        if (legacy)
+        {
+            char **args = legacy_parse_line(copy);
+            token_total += args[0] != NULL;
+            free(args);
+        }
+        else
+        {
+            arena_reset(&LINE_ARENA);
+            char **args = parse_line(copy);
+            token_total += args != NULL && args[0] != NULL;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (token_total != BENCH_LINES)
+    {
+        fprintf(stderr, "parser rejected %zu lines\n", BENCH_LINES - token_total);
+    }
+    return (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main()
+{
+    OUTPUT = stdout;
+    ERROUTPUT = stderr;
+
+    size_t size;
+    char **lines = generate_lines(&size);
+    printf("%d lines, %.1f MB, best of %d runs\n", BENCH_LINES, (double)size / 1e6, BENCH_RUNS);
+
+    const char *names[] = {"strtok + parse_subtokens", "scan_line"};
+    for (int parser = 0; parser < 2; parser++)
+    {
+        double best = 0;
+        for (int run = 0; run < BENCH_RUNS; run++)
+        {
+            double elapsed = run_parser(lines, parser == 0);
+            best = run == 0 || elapsed < best ? elapsed : best;
+        }
+        printf("  %-25s %8.1f ms (%6.1f MB/s)\n", names[parser], best * 1e3, (double)size / 1e6 / best);
+    }
+
+    for (size_t i = 0; i < BENCH_LINES; i++)
+    {
+        free(lines[i]);
+    }
+    free(lines);
+    arena_release(&LINE_ARENA);
+    return EXIT_SUCCESS;
+}
@@ -2,9 +2,11 @@
  * WISH - Wisconsin Shell
  *
  * A simple Unix shell implementation with support for:
- * - Basic command execution
- * - Built-in commands: exit, cd, path
- * - I/O redirection with '>' operator
+ * - Basic command execution (fork or posix_spawn launcher)
+ * - Built-in commands: exit, cd, path, hash, jobs-limit, load-limit, cat, tee,
+ *   parallel, times, stats and the timeout prefix
+ * - I/O redirection with '<', '>', '>>', 'N>', '&>' and 'N>&M' operators
+ * - Pipelines with '|' operator
  * - Parallel command execution with '&' operator
  * - Batch mode execution from input files
  *
@@ -14,440 +16,6294 @@
  */
 
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <sched.h>
 #include <signal.h>
+#include <spawn.h>
+#include <dirent.h>
+#include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
-#define TOKENS_NUMBER 64                    // Maximum number of tokens in a command
-#define MAX_PARALLEL_PROCESSES 16          // Maximum number of parallel processes
+#define TOKENS_INITIAL_CAPACITY 64          // Initial size of a line's token vector
+#define JOB_TABLE_INITIAL_CAPACITY 16       // Initial size of the job table
+#define STREAM_CHUNK (64 * 1024)            // Bytes moved per splice/tee/read call
 #define DELIM " \t\n\r"                     // Delimiters for tokenizing input
-#define REDIRECTION_DELIM ">"               // Redirection operator
+#define REDIRECTION_DELIM ">"               // Output redirection operator
+#define INPUT_REDIRECTION_DELIM "<"         // Input redirection operator
 #define PARALLEL_DELIM "&"                  // Parallel command separator
+#define PIPE_DELIM "|"                      // Pipeline stage separator
+#define PARALLEL_ITEMS_DELIM ":::"          // Separates a 'parallel' command from its items
+#define PARALLEL_PLACEHOLDER "{}"           // Replaced by each item in a 'parallel' command
+#define WORD_TERMINATORS DELIM "<>&|"       // Characters that end a word
 #define ERROR_MSG "An error has occurred\n" // Standard error message
+#define TIMEOUT_MSG "A command has timed out\n" // Reported when a job is stopped for running too long
+
+// Kinds of tokens recognised on a command line
+enum token_type
+{
+    TOKEN_WORD,        // Command name, argument or file name
+    TOKEN_REDIRECTION, // '<', '>', '>>', 'N>', '&>', 'N>&M', ...
+    TOKEN_PARALLEL,    // PARALLEL_DELIM
+    TOKEN_PIPE,        // PIPE_DELIM
+};
+
+// A token as a slice of the input line
+struct token_slice
+{
+    enum token_type type; // What the slice holds
+    size_t offset;        // Start of the token in the line
+    size_t length;        // Length of the token in bytes
+};
+
+// Arena-backed vector of token slices that grows geometrically
+struct token_vector
+{
+    struct token_slice *items; // Slices in line order
+    size_t count;              // Number of slices stored
+    size_t capacity;           // Allocated size of items
+    struct arena *arena;       // Arena the items are allocated from
+};
+
+#define ARENA_INITIAL_CAPACITY 4096 // Size of the first arena chunk
+#define ARENA_ALIGNMENT 16          // Alignment of every arena allocation
+
+// A block of memory handed out by an arena
+struct arena_chunk
+{
+    struct arena_chunk *next; // Previously filled chunk
+    size_t capacity;          // Usable bytes in data
+    size_t used;              // Bytes handed out so far
+    char data[];              // The memory itself
+};
+
+// Bump allocator whose allocations are all released at once by arena_reset()
+struct arena
+{
+    struct arena_chunk *head; // Chunk allocations are currently taken from
+};
+
+struct arena LINE_ARENA = {NULL}; // Backs all parsing and dispatch of one line
+
+// Kinds of redirection a command can carry
+enum redirection_kind
+{
+    REDIRECT_OPEN, // Open a file as the descriptor ('<', '>', '>>', '2>', ...)
+    REDIRECT_DUP,  // Make the descriptor a copy of another one ('2>&1')
+};
+
+// One redirection; a command's redirections are applied in line order
+struct redirection
+{
+    enum redirection_kind kind;
+    int fd;           // Descriptor being redirected
+    int flags;        // open() flags for REDIRECT_OPEN
+    const char *path; // File opened by REDIRECT_OPEN
+    int source_fd;    // Descriptor copied by REDIRECT_DUP
+};
+
+// Redirections of one command, allocated from LINE_ARENA
+struct redirection_list
+{
+    struct redirection *items; // Redirections in line order
+    size_t count;              // Number of redirections
+    int position;              // Index of the first redirection token, or -1
+};
 
 // Array of PATH directories where commands will be searched
-char *PATH[TOKENS_NUMBER] = {NULL}; // Initialize all elements to NULL
+char **PATH = NULL;       // NULL-terminated, grown as needed
+size_t PATH_CAPACITY = 0; // Allocated size of PATH
+
+// Global file handles for shell I/O operations
+FILE *OUTPUT;    // Output stream
+FILE *INPUT;     // Input stream
+FILE *ERROUTPUT; // Error stream
+
+bool SHELL_RUNNING = true;  // Controls the main shell loop execution
+
+extern char **environ; // Environment passed on to spawned commands
+
+// Strategies available for starting external commands
+enum launcher_mode
+{
+    LAUNCHER_FORK,  // fork() the shell, then apply redirection and execv() in the child
+    LAUNCHER_SPAWN, // resolve in the shell, then posix_spawn() (vfork-style clone)
+};
+
+enum launcher_mode LAUNCHER = LAUNCHER_SPAWN; // Selected with --launcher
+
+// Process group the children of the job being started join: -1 for the
+// shell's own, 0 for a new one led by the next child
+pid_t LAUNCH_PROCESS_GROUP = -1;
+
+#define COMMAND_HASH_INITIAL_BUCKETS 64 // Initial bucket count (power of two)
+
+// Remembered location of a command, as shown by the 'hash' builtin
+struct command_hash_entry
+{
+    char *name;                       // Command name as typed
+    char *path;                       // Resolved absolute path, or NULL if not found
+    unsigned int hits;                // Number of times the entry was used
+    unsigned long generation;         // PATH_GENERATION the entry was resolved under
+    struct command_hash_entry *next;  // Next entry in the same bucket
+};
+
+// Hash table mapping command names to executables found in PATH
+struct command_hash
+{
+    struct command_hash_entry **buckets; // Chained buckets (count is a power of two)
+    size_t bucket_count;                 // Number of buckets
+    size_t entry_count;                  // Number of remembered commands
+};
+
+struct command_hash COMMAND_HASH = {NULL, 0, 0};
+
+unsigned long PATH_GENERATION = 0; // Incremented every time PATH changes
+
+// Life cycle of a job in the scheduler
+enum job_state
+{
+    JOB_PENDING, // Queued, waiting for a free slot
+    JOB_RUNNING, // Child process started and not reaped yet
+    JOB_DONE,    // Finished, or never needed a child process
+};
+
+// Where the output of the commands of a line goes
+enum output_mode
+{
+    OUTPUT_SHARED, // Children write straight to the shell's standard output and error
+    OUTPUT_GROUP,  // Each job's output is collected and written out when it finishes
+    OUTPUT_TAG,    // Each complete line is written as it arrives, prefixed with a tag
+};
+
+enum output_mode OUTPUT_MODE = OUTPUT_SHARED; // Selected with --group-output or --tag
+
+// What identifies a job's lines in OUTPUT_TAG mode
+enum tag_source
+{
+    TAG_JOB_NUMBER,   // Position of the job in its line, starting at 1
+    TAG_COMMAND_NAME, // Name of the job's (first) command
+};
+
+enum tag_source TAG_SOURCE = TAG_JOB_NUMBER; // Selected with --tag=number|command
+
+char *TAG_BUFFER = NULL;     // Scratch space for composing tagged lines
+size_t TAG_BUFFER_SIZE = 0;  // Allocated size of TAG_BUFFER
+
+#define OUTPUT_SPILL_THRESHOLD (1024 * 1024) // Captured bytes kept in memory per stream
+
+// Output captured from one stream (standard output or error) of a job
+struct output_buffer
+{
+    int read_fd;     // Read end of the job's pipe, or -1 if not captured or drained
+    int target_fd;   // Shell descriptor the output is written to
+    char *data;      // Captured bytes not spilled yet
+    size_t length;   // Number of bytes in data
+    size_t capacity; // Allocated size of data
+    int spill_fd;    // memfd holding earlier output once it outgrew memory, or -1
+};
+
+// One '&'-separated command of the current line, possibly a pipeline
+struct job
+{
+    char **args;              // NULL-terminated arguments, stages split by '|'
+    size_t first_process;     // Index of the job's first process in PROCESSES
+    size_t process_count;     // Number of processes started for the job
+    size_t running_processes; // Number of those not reaped yet
+    int status;               // Wait status of the last pipeline stage
+    enum job_state state;     // Where the job is in its life cycle
+    struct output_buffer output[2]; // Captured standard output and error
+    size_t open_outputs;      // Captured streams not at end of file yet
+    size_t batch_line;        // Line of the batch in --parallel-batch mode, or SIZE_MAX
+    int jobserver_token;      // Token taken from the jobserver for the job, or -1
+    size_t affinity_unit;     // Unit of AFFINITY the job is pinned to, or SIZE_MAX
+    pid_t process_group;      // Own process group of a job with a timeout, or 0
+    int timeout_fd;           // timerfd ending a job with a timeout, or -1
+    bool timed_out;           // Whether the job was signalled for running too long
+    struct timespec started_at;  // When the job was started
+    struct timespec finished_at; // When its last process was reaped
+    struct rusage usage;         // Resources used by its processes, summed
+};
+
+// A child process started for a job (one per pipeline stage)
+struct process
+{
+    pid_t pid;    // Process ID
+    int pidfd;    // Process file descriptor watched by the event loop, or -1
+    int status;   // Wait status once the child has been reaped
+    size_t job;   // Index of the owning job in JOBS
+    bool running; // Whether the child still has to be reaped
+    char **args;  // Arguments of the pipeline stage the child runs
+    struct timespec started_at; // When the child was started (only with --trace)
+};
+
+// Growable table of the processes started for the current line
+struct process_table
+{
+    struct process *processes; // Processes in start order
+    size_t count;              // Number of processes started for the line
+    size_t capacity;           // Allocated size of processes
+};
+
+struct process_table PROCESSES = {NULL, 0, 0};
+
+// Growable queue of the jobs of the current line, in the order they appear
+struct job_table
+{
+    struct job *jobs;     // Jobs in line order
+    size_t count;         // Number of jobs queued for the current line
+    size_t capacity;      // Allocated size of jobs
+    size_t next_pending;  // Index of the next job to start
+    size_t running;       // Number of jobs not reaped yet
+};
+
+struct job_table JOBS = {NULL, 0, 0, 0, 0};
+
+size_t JOBS_LIMIT = 0; // Maximum number of running jobs (-j), 0 for no limit
+bool JOBS_LIMIT_GIVEN = false; // Whether -j was given on the command line
+
+#define JOB_TIMEOUT_PREFIX "timeout"   // Prefix giving a single command a time limit
+#define JOB_TIMEOUT_KILL_SECONDS 5     // Delay between SIGTERM and SIGKILL for a timed-out job
+
+double JOB_TIMEOUT = 0; // Seconds a job may run (--job-timeout), 0 for no limit
+
+#define USAGE_COMMAND_LENGTH 64 // Bytes of a command's text kept with its usage
+
+// Resources used by one command of a line, all stages of a pipeline together
+struct command_usage
+{
+    char command[USAGE_COMMAND_LENGTH]; // The command's words, cut to fit
+    double real_seconds;                // Wall time from start to the last stage's exit
+    double user_seconds;                // CPU time spent in user mode
+    double system_seconds;              // CPU time spent in the kernel
+    long max_rss_kb;                    // Largest resident set of any stage (KiB)
+    long voluntary_switches;            // Context switches while waiting, e.g. for I/O
+    long involuntary_switches;          // Context switches forced by the scheduler
+    int status;                         // Wait status of the last stage
+    bool timed_out;                     // Whether the command hit its time limit
+};
+
+// Usage of the commands of the last line that started any
+struct usage_log
+{
+    struct command_usage *records; // One per command, in line order
+    size_t count;                  // Number of records
+    size_t capacity;               // Allocated size of records
+};
+
+struct usage_log USAGE = {NULL, 0, 0};
+
+int USAGE_REPORT_FD = -1; // Descriptor each line's usage is written to (--usage-report), or -1
+
+#define TRACE_BUFFER_SIZE (64 * 1024) // Bytes of trace events collected before each write
+#define TRACE_TEXT_LENGTH 200         // Bytes of a name or command kept in a trace event
+
+// Chrome trace-event writer (--trace): complete events in the JSON object
+// format, collected in a buffer and written in large chunks
+struct trace_writer
+{
+    int fd;                 // Trace file, or -1 when not tracing
+    char *buffer;           // Events not written yet
+    size_t length;          // Number of bytes in buffer
+    bool has_events;        // Whether the next event needs a separating comma
+    struct timespec origin; // Time 0 of the trace
+    long pid;               // The shell's process ID, used as the trace's process
+};
+
+struct trace_writer TRACE = {.fd = -1, .buffer = NULL, .length = 0, .has_events = false, .pid = 0};
+
+#define HISTOGRAM_SUB_BUCKET_BITS 5 // Significant bits kept per value (about 3% precision)
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+// Log-linear histogram of durations in nanoseconds, in the style of
+// HdrHistogram: values below HISTOGRAM_SUB_BUCKETS are exact, larger ones
+// keep their top HISTOGRAM_SUB_BUCKET_BITS bits
+struct histogram
+{
+    uint64_t counts[HISTOGRAM_BUCKETS]; // Number of values per bucket
+    uint64_t total;                     // Number of values recorded
+    uint64_t sum;                       // Sum of the values, for the mean
+    uint64_t min;                       // Smallest value recorded
+    uint64_t max;                       // Largest value recorded
+};
+
+// Counters and latency histograms kept for the 'stats' built-in
+struct shell_stats
+{
+    uint64_t lines;            // Lines with at least one command
+    uint64_t commands;         // '&'-separated commands started, built-ins included
+    uint64_t builtins;         // Commands run as built-ins
+    uint64_t lookup_failures;  // Commands not found in PATH
+    uint64_t exec_failures;    // Processes that couldn't be started
+    struct histogram dispatch; // From reading a line to reaping its last child
+    struct histogram spawn;    // Time spent starting each process
+    struct histogram runtime;  // From starting a command to the exit of its last process
+};
+
+struct shell_stats STATS; // Zero-initialised: nothing recorded yet
+bool STATS_ON_EXIT = false; // Print the statistics when the shell exits (--stats-on-exit)
+
+#define LOAD_CACHE_NS 250000000L // Readings younger than this are reused (ns)
+#define LOAD_RECHECK_SECONDS 1    // Delay before checking the load again when held back
+
+// Load limits that hold back new jobs; a limit of 0 is ignored
+struct load_limits
+{
+    double max_load;             // 1-minute load average (/proc/loadavg)
+    double max_cpu_pressure;     // CPU pressure, "some avg10" % (/proc/pressure/cpu)
+    double max_memory_pressure;  // Memory pressure, "some avg10" % (/proc/pressure/memory)
+    int timer_fd;                // timerfd waking the scheduler to check again, or -1
+    bool timer_armed;            // Whether the timer is running
+    bool overloaded;             // Result of the last check
+    struct timespec checked_at;  // When the last check read the readings
+};
+
+struct load_limits LOAD = {.max_load = 0, .max_cpu_pressure = 0, .max_memory_pressure = 0, .timer_fd = -1};
+
+// How --affinity places jobs on the CPUs the shell may use
+enum affinity_policy
+{
+    AFFINITY_NONE,        // Jobs run wherever the kernel puts them
+    AFFINITY_COMPACT,     // Fill units in topology order, so jobs share caches
+    AFFINITY_SCATTER,     // Spread jobs over cores and nodes, least loaded unit first
+    AFFINITY_ROUND_ROBIN, // Job N goes to unit N modulo the number of units
+};
+
+// A CPU the shell may use and where it sits in the machine
+struct affinity_cpu
+{
+    int cpu;       // CPU number
+    int node;      // NUMA node, 0 without NUMA information
+    int core;      // Lowest-numbered hardware thread of the CPU's core
+    int thread;    // Position among the usable threads of its core
+    int node_rank; // Position among the CPUs of its node with the same thread
+};
+
+// A place jobs are pinned to: one CPU, or a NUMA node's CPUs with --numa
+struct affinity_unit
+{
+    cpu_set_t cpus;  // CPUs of the unit the shell may use
+    size_t capacity; // Number of those CPUs
+    size_t running;  // Running jobs pinned to the unit
+};
+
+struct affinity
+{
+    enum affinity_policy policy; // Selected with --affinity
+    bool numa;                   // Pin jobs to whole NUMA nodes (--numa)
+    cpu_set_t allowed;           // The shell's own CPU set
+    struct affinity_unit *units; // Units in placement order
+    size_t unit_count;           // Number of units
+};
+
+struct affinity AFFINITY = {.policy = AFFINITY_NONE, .numa = false, .units = NULL, .unit_count = 0};
+
+#define JOBSERVER_TOKEN '+' // Token byte written by a jobserver we create
+
+// GNU make jobserver: a pipe (or named FIFO) holding one byte per job that
+// may run besides the one every make process may always run (the implicit
+// token). Used as a client of an outer make, or created for sub-makes.
+struct jobserver
+{
+    bool active;          // Whether jobs need tokens at all
+    int read_fd;          // Non-blocking descriptor of our own to take tokens from
+    int write_fd;         // Descriptor tokens are returned to
+    bool implicit_in_use; // Whether a running job uses the implicit token
+    bool waiting;         // Whether read_fd is registered with the event loop
+};
+
+struct jobserver JOBSERVER = {.active = false, .read_fd = -1, .write_fd = -1};
+
+bool PARALLEL_BATCH = false; // Run independent batch lines concurrently (--parallel-batch)
+
+// A line of the batch file in --parallel-batch mode, a node of the
+// dependency graph
+struct batch_line
+{
+    char ***commands;          // Arguments of each '&'-separated command
+    size_t command_count;      // Number of commands on the line
+    size_t unfinished_jobs;    // Jobs of the line that are queued or running
+    size_t waiting_for;        // Earlier lines that still have to finish
+    size_t *successors;        // Later lines waiting for this one
+    size_t successor_count;    // Number of successors
+    size_t successor_capacity; // Allocated size of successors
+    struct timespec ready_at;  // When the line's jobs were queued
+};
+
+// Dependency graph of a whole batch file, allocated from LINE_ARENA
+struct batch_graph
+{
+    struct batch_line *lines; // Non-empty lines in file order
+    size_t count;             // Number of lines
+    size_t capacity;          // Allocated size of lines
+};
+
+struct batch_graph BATCH = {NULL, 0, 0};
+
+#define FILE_ACCESS_INITIAL_CAPACITY 64 // Initial slot count (power of two)
+
+// Lines of a batch that access one file, for dependency analysis
+struct file_access
+{
+    const char *name;       // File name as written, or NULL for a free slot
+    size_t last_writer;     // Last line writing the file, or SIZE_MAX
+    size_t *readers;        // Lines naming the file since it was last written
+    size_t reader_count;    // Number of readers
+    size_t reader_capacity; // Allocated size of readers
+};
+
+// Open-addressing table of the files named since the last barrier line
+struct file_access_table
+{
+    struct file_access *slots; // Slots (count is a power of two)
+    size_t capacity;           // Number of slots
+    size_t count;              // Number of files
+};
+
+// Command of the 'parallel' built-in, analysed once for all of its items
+struct parallel_template
+{
+    char **args;          // Template arguments
+    size_t length;        // Number of template arguments
+    size_t *placeholders; // Number of PARALLEL_PLACEHOLDER in each argument
+    size_t item_position; // Where the item is inserted when there is no
+                          // placeholder at all, or SIZE_MAX
+};
+
+#define EVENT_BATCH 32 // Maximum number of events handled per epoll_wait()
+
+// Sources the event loop can wake up for, stored in the upper half of the
+// epoll data with the process or stream index (if any) in the lower half
+enum event_source
+{
+    EVENT_CHILD_EXIT = 1, // A process's pidfd became readable
+    EVENT_SIGCHLD,        // signalfd fallback reported SIGCHLD
+    EVENT_JOB_OUTPUT,     // A job's output pipe is readable (index: job * 2 + stream)
+    EVENT_JOBSERVER,      // A jobserver token may be available
+    EVENT_LOAD_TIMER,     // Time to check whether the load has dropped
+    EVENT_JOB_TIMEOUT,    // A job's timeout timer expired (index: job)
+};
+
+#define EVENT_DATA(source, index) (((uint64_t)(source) << 32) | (uint32_t)(index))
+#define EVENT_SOURCE(data) ((enum event_source)((data) >> 32))
+#define EVENT_INDEX(data) ((size_t)(uint32_t)(data))
+
+// Event loop used to reap children in the order they finish
+struct event_loop
+{
+    int epoll_fd;          // epoll instance, or -1 to fall back to waitpid()
+    int signal_fd;         // signalfd for SIGCHLD when pidfds are unavailable
+    bool use_pidfd;        // Whether each child is watched through a pidfd
+    sigset_t child_mask;   // Signal mask to restore in child processes
+};
+
+struct event_loop EVENTS = {.epoll_fd = -1, .signal_fd = -1, .use_pidfd = false};
+
+#define PATH_INDEX_MAGIC "WISHIDX1" // Identifies a PATH index file
+#define PATH_INDEX_VERSION 1        // Bumped whenever the layout changes
+#define PATH_INDEX_REBUILD_NS 1000000000L // Minimum time between rebuilds while PATH directories keep changing
+
+/*
+ * On-disk PATH index layout (native byte order, read through mmap):
+ *   header | directory records | hash slots | string table
+ * String offsets are relative to the start of the string table, and offset 0
+ * holds an empty string so that a zero name offset marks an unused slot.
+ */
+struct path_index_header
+{
+    char magic[8];            // PATH_INDEX_MAGIC
+    uint32_t version;         // PATH_INDEX_VERSION
+    uint32_t directory_count; // Number of PATH directories the index covers
+    uint32_t slot_count;      // Number of hash slots (power of two)
+    uint32_t entry_count;     // Number of executables recorded
+    uint64_t string_size;     // Size of the string table in bytes
+};
+
+// A PATH directory and the modification time it had when it was scanned
+struct path_index_directory
+{
+    uint32_t name_offset; // Directory path in the string table
+    uint32_t exists;      // Whether the directory could be scanned
+    int64_t mtime_sec;    // Directory mtime seconds
+    int64_t mtime_nsec;   // Directory mtime nanoseconds
+};
+
+// Open-addressing slot mapping an executable name to its PATH directory
+struct path_index_slot
+{
+    uint32_t hash;        // hash_command_name() of the executable name
+    uint32_t name_offset; // Executable name in the string table (0 if unused)
+    uint32_t directory;   // Index of the first PATH directory containing it
+    uint32_t reserved;    // Keeps slots 16 bytes wide
+};
+
+// State of the optional PATH index shared between shell invocations
+struct path_index
+{
+    char *file_path;   // Index file (--path-index or WISH_PATH_INDEX), or NULL
+    void *map;         // Read-only mapping of the index file
+    size_t map_size;   // Size of the mapping
+    bool validated;    // Whether the mapping was checked against PATH
+    bool failed;                     // Whether the index couldn't be built or mapped
+    unsigned long failed_generation; // PATH_GENERATION of the failed attempt
+    struct timespec *failed_mtimes;  // Modification time of each PATH directory then (0 if missing)
+    size_t failed_count;             // Number of entries in failed_mtimes
+    struct timespec rebuilt_at;      // When the index was last rebuilt
+};
+
+struct path_index PATH_INDEX = {NULL, NULL, 0, false, false, 0, NULL, 0, {0, 0}};
+
+// Changes to these directories invalidate remembered command locations
+#define PATH_WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+
+// inotify watches over the PATH directories
+struct path_watcher
+{
+    int inotify_fd;           // Non-blocking inotify instance, or -1 if unavailable
+    int *watch_descriptors;   // One watch per PATH entry (-1 if it couldn't be watched)
+    size_t watch_count;       // Number of entries in watch_descriptors
+};
+
+struct path_watcher PATH_WATCHER = {-1, NULL, 0};
+
+/**
+ * Makes sure PATH can hold a number of entries plus its NULL terminator
+ * @param count Number of directories PATH must be able to hold
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ */
+int path_reserve(size_t count)
+{
+    if (count + 1 <= PATH_CAPACITY)
+    {
+        return EXIT_SUCCESS;
+    }
+
+    size_t new_capacity = PATH_CAPACITY ? PATH_CAPACITY : 4;
+    while (new_capacity < count + 1)
+    {
+        new_capacity *= 2;
+    }
+    char **new_path = realloc(PATH, new_capacity * sizeof(char *));
+    if (new_path == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    PATH = new_path;
+    PATH_CAPACITY = new_capacity;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Initializes default path directories
+ */
+void initialize_path()
+{
+    if (path_reserve(2))
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    PATH[0] = strdup("/bin");
+    PATH[1] = strdup("/usr/bin");
+    PATH[2] = NULL;
+}
+
+/**
+ * Constructs a full executable path by combining directory path with command
+ * name
+ * @param path Directory path to search in
+ * @param command Command to execute
+ * @return Newly allocated string containing the full path (caller must free)
+ */
+char *create_executable_path(char *path, char *command)
+{
+    // Allocate memory for the full path (path + / + command + null terminator)
+    char *full_path = malloc(strlen(path) + strlen(command) + 2);
+    if (full_path == NULL)
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+    // Construct the full path
+    strcpy(full_path, path);
+    strcat(full_path, "/");
+    strcat(full_path, command);
+    return full_path;
+}
+
+/**
+ * Searches the PATH directories for an executable file
+ * @param command Command name to look up
+ * @return Newly allocated full path of the first executable match (caller must
+ * free), or NULL if the command wasn't found
+ */
+char *resolve_executable(char *command)
+{
+    struct stat file_info;
+
+    for (int path_count = 0; PATH[path_count] != NULL; path_count++)
+    {
+        char *executable_path = create_executable_path(PATH[path_count], command);
+
+        // Accept only regular files the shell is allowed to execute
+        if (!stat(executable_path, &file_info) && S_ISREG(file_info.st_mode) &&
+            !access(executable_path, X_OK))
+        {
+            return executable_path;
+        }
+        free(executable_path);
+    }
+    return NULL;
+}
+
+/**
+ * Computes the FNV-1a hash of a command name
+ * @param name NUL-terminated command name
+ * @return 32-bit hash value
+ */
+unsigned int hash_command_name(const char *name)
+{
+    unsigned int hash = 2166136261u;
+    while (*name)
+    {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Finds a command in the hash table
+ * @param name Command name to look up
+ * @return Matching entry, or NULL if the command isn't remembered
+ */
+struct command_hash_entry *command_hash_find(const char *name)
+{
+    if (COMMAND_HASH.bucket_count == 0)
+    {
+        return NULL;
+    }
+
+    unsigned int bucket = hash_command_name(name) & (COMMAND_HASH.bucket_count - 1);
+    for (struct command_hash_entry *entry = COMMAND_HASH.buckets[bucket]; entry != NULL; entry = entry->next)
+    {
+        if (!strcmp(entry->name, name))
+        {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Doubles the number of buckets and redistributes the existing entries
+ */
+void command_hash_grow()
+{
+    size_t new_bucket_count = COMMAND_HASH.bucket_count ? COMMAND_HASH.bucket_count * 2 : COMMAND_HASH_INITIAL_BUCKETS;
+    struct command_hash_entry **new_buckets = calloc(new_bucket_count, sizeof(*new_buckets));
+    if (new_buckets == NULL)
+    {
+        // Keep using the current buckets; chains just get longer
+        return;
+    }
+
+    for (size_t i = 0; i < COMMAND_HASH.bucket_count; i++)
+    {
+        struct command_hash_entry *entry = COMMAND_HASH.buckets[i];
+        while (entry != NULL)
+        {
+            struct command_hash_entry *next = entry->next;
+            unsigned int bucket = hash_command_name(entry->name) & (new_bucket_count - 1);
+            entry->next = new_buckets[bucket];
+            new_buckets[bucket] = entry;
+            entry = next;
+        }
+    }
+
+    free(COMMAND_HASH.buckets);
+    COMMAND_HASH.buckets = new_buckets;
+    COMMAND_HASH.bucket_count = new_bucket_count;
+}
+
+/**
+ * Remembers the resolved path of a command
+ * @param name Command name (copied)
+ * @param path Absolute path of the executable (ownership is taken), or NULL to
+ * remember that the command isn't in PATH
+ * @return The new entry, or NULL if memory couldn't be allocated
+ */
+struct command_hash_entry *command_hash_insert(const char *name, char *path)
+{
+    // Keep the average chain length at or below one entry
+    if (COMMAND_HASH.entry_count >= COMMAND_HASH.bucket_count)
+    {
+        command_hash_grow();
+    }
+    if (COMMAND_HASH.bucket_count == 0)
+    {
+        return NULL;
+    }
+
+    struct command_hash_entry *entry = malloc(sizeof(*entry));
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->hits = 0;
+    entry->generation = PATH_GENERATION;
+
+    unsigned int bucket = hash_command_name(name) & (COMMAND_HASH.bucket_count - 1);
+    entry->next = COMMAND_HASH.buckets[bucket];
+    COMMAND_HASH.buckets[bucket] = entry;
+    COMMAND_HASH.entry_count++;
+    return entry;
+}
+
+/**
+ * Forgets the remembered location of a single command
+ * @param name Command name to forget
+ */
+void command_hash_remove(const char *name)
+{
+    if (COMMAND_HASH.bucket_count == 0)
+    {
+        return;
+    }
+
+    unsigned int bucket = hash_command_name(name) & (COMMAND_HASH.bucket_count - 1);
+    struct command_hash_entry **link = &COMMAND_HASH.buckets[bucket];
+    while (*link != NULL)
+    {
+        struct command_hash_entry *entry = *link;
+        if (!strcmp(entry->name, name))
+        {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            COMMAND_HASH.entry_count--;
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+/**
+ * Forgets every remembered command location
+ */
+void command_hash_clear()
+{
+    for (size_t i = 0; i < COMMAND_HASH.bucket_count; i++)
+    {
+        struct command_hash_entry *entry = COMMAND_HASH.buckets[i];
+        while (entry != NULL)
+        {
+            struct command_hash_entry *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        COMMAND_HASH.buckets[i] = NULL;
+    }
+    COMMAND_HASH.entry_count = 0;
+}
+
+/**
+ * Releases the mapping of the PATH index file
+ */
+void path_index_unmap()
+{
+    if (PATH_INDEX.map != NULL)
+    {
+        munmap(PATH_INDEX.map, PATH_INDEX.map_size);
+        PATH_INDEX.map = NULL;
+        PATH_INDEX.map_size = 0;
+    }
+    PATH_INDEX.validated = false;
+}
+
+/**
+ * Maps the PATH index file into memory and checks its layout
+ * @return EXIT_SUCCESS if a structurally valid index was mapped, EXIT_FAILURE
+ * otherwise
+ */
+int path_index_map()
+{
+    path_index_unmap();
+
+    int file_descriptor = open(PATH_INDEX.file_path, O_RDONLY | O_CLOEXEC);
+    if (file_descriptor == -1)
+    {
+        return EXIT_FAILURE;
+    }
+
+    struct stat file_info;
+    if (fstat(file_descriptor, &file_info) || (size_t)file_info.st_size < sizeof(struct path_index_header))
+    {
+        close(file_descriptor);
+        return EXIT_FAILURE;
+    }
+
+    void *map = mmap(NULL, file_info.st_size, PROT_READ, MAP_SHARED, file_descriptor, 0);
+    close(file_descriptor); // The mapping stays valid after closing
+    if (map == MAP_FAILED)
+    {
+        return EXIT_FAILURE;
+    }
+
+    // Make sure the header describes a file of exactly this size, and that
+    // the string table (at the end) is terminated, so no string read from a
+    // damaged or foreign file runs past the mapping
+    const struct path_index_header *header = map;
+    size_t expected_size = sizeof(*header) +
+                           (size_t)header->directory_count * sizeof(struct path_index_directory) +
+                           (size_t)header->slot_count * sizeof(struct path_index_slot) +
+                           header->string_size;
+    if (memcmp(header->magic, PATH_INDEX_MAGIC, sizeof(header->magic)) ||
+        header->version != PATH_INDEX_VERSION || header->slot_count == 0 ||
+        (header->slot_count & (header->slot_count - 1)) || header->string_size == 0 ||
+        expected_size != (size_t)file_info.st_size || ((const char *)map)[file_info.st_size - 1] != '\0')
+    {
+        munmap(map, file_info.st_size);
+        return EXIT_FAILURE;
+    }
+
+    PATH_INDEX.map = map;
+    PATH_INDEX.map_size = file_info.st_size;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Returns the directory records of the mapped PATH index
+ */
+const struct path_index_directory *path_index_directories()
+{
+    return (const struct path_index_directory *)((const char *)PATH_INDEX.map + sizeof(struct path_index_header));
+}
+
+/**
+ * Returns the hash slots of the mapped PATH index
+ */
+const struct path_index_slot *path_index_slots()
+{
+    const struct path_index_header *header = PATH_INDEX.map;
+    return (const struct path_index_slot *)(path_index_directories() + header->directory_count);
+}
+
+/**
+ * Returns the string table of the mapped PATH index
+ */
+const char *path_index_strings()
+{
+    const struct path_index_header *header = PATH_INDEX.map;
+    return (const char *)(path_index_slots() + header->slot_count);
+}
+
+/**
+ * Checks that the mapped index covers the current PATH and that no directory
+ * was modified since the index was built
+ * @return true if the index can be used for lookups
+ */
+bool path_index_is_current()
+{
+    const struct path_index_header *header = PATH_INDEX.map;
+    const struct path_index_directory *directories = path_index_directories();
+    const char *strings = path_index_strings();
+    uint32_t path_count = 0;
+
+    while (PATH[path_count] != NULL)
+    {
+        path_count++;
+    }
+    if (header->directory_count != path_count)
+    {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < path_count; i++)
+    {
+        struct stat directory_info;
+        bool exists = !stat(PATH[i], &directory_info);
+
+        if (directories[i].name_offset >= header->string_size ||
+            strcmp(strings + directories[i].name_offset, PATH[i]) ||
+            directories[i].exists != exists)
+        {
+            return false;
+        }
+        if (exists && (directories[i].mtime_sec != directory_info.st_mtim.tv_sec ||
+                       directories[i].mtime_nsec != directory_info.st_mtim.tv_nsec))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Appends a string to a growing string table
+ * @param table Pointer to the table buffer (reallocated as needed)
+ * @param size Pointer to the used size of the table
+ * @param capacity Pointer to the allocated size of the table
+ * @param string String to append, including its terminator
+ * @return Offset of the string in the table, or 0 on allocation failure
+ */
+uint32_t path_index_add_string(char **table, size_t *size, size_t *capacity, const char *string)
+{
+    size_t length = strlen(string) + 1;
+    if (*size + length > *capacity)
+    {
+        size_t new_capacity = *capacity ? *capacity * 2 : 4096;
+        while (*size + length > new_capacity)
+        {
+            new_capacity *= 2;
+        }
+        char *new_table = realloc(*table, new_capacity);
+        if (new_table == NULL)
+        {
+            return 0;
+        }
+        *table = new_table;
+        *capacity = new_capacity;
+    }
+    memcpy(*table + *size, string, length);
+    *size += length;
+    return (uint32_t)(*size - length);
+}
+
+/**
+ * Scans every PATH directory and atomically replaces the index file
+ * @return EXIT_SUCCESS if the index was written, EXIT_FAILURE otherwise
+ *
+ * Directories are stat'ed before they are read, so a directory modified during
+ * the scan makes the index look stale and it is simply rebuilt next time.
+ */
+int path_index_build()
+{
+    uint32_t path_count = 0;
+    while (PATH[path_count] != NULL)
+    {
+        path_count++;
+    }
+
+    struct path_index_directory *directories = calloc(path_count ? path_count : 1, sizeof(*directories));
+    char *strings = NULL;
+    size_t string_size = 0;
+    size_t string_capacity = 0;
+
+    // Collected executables: parallel arrays of name offsets and directories
+    uint32_t *names = NULL;
+    uint32_t *owners = NULL;
+    size_t entry_count = 0;
+    size_t entry_capacity = 0;
+    int status = EXIT_FAILURE;
+
+    // Offset 0 is reserved for the empty string marking unused slots
+    if (directories == NULL || path_index_add_string(&strings, &string_size, &string_capacity, "") != 0 ||
+        string_size != 1)
+    {
+        goto cleanup;
+    }
+
+    for (uint32_t i = 0; i < path_count; i++)
+    {
+        struct stat directory_info;
+        directories[i].name_offset = path_index_add_string(&strings, &string_size, &string_capacity, PATH[i]);
+        if (directories[i].name_offset == 0)
+        {
+            goto cleanup;
+        }
+        if (stat(PATH[i], &directory_info))
+        {
+            continue;
+        }
+
+        directories[i].exists = 1;
+        directories[i].mtime_sec = directory_info.st_mtim.tv_sec;
+        directories[i].mtime_nsec = directory_info.st_mtim.tv_nsec;
+
+        DIR *directory = opendir(PATH[i]);
+        if (directory == NULL)
+        {
+            continue;
+        }
+
+        struct dirent *directory_entry;
+        while ((directory_entry = readdir(directory)) != NULL)
+        {
+            struct stat file_info;
+
+            // Same acceptance rule as resolve_executable()
+            if (directory_entry->d_name[0] == '.' &&
+                (directory_entry->d_name[1] == '\0' || !strcmp(directory_entry->d_name, "..")))
+            {
+                continue;
+            }
+            if (fstatat(dirfd(directory), directory_entry->d_name, &file_info, 0) ||
+                !S_ISREG(file_info.st_mode) ||
+                faccessat(dirfd(directory), directory_entry->d_name, X_OK, 0))
+            {
+                continue;
+            }
+
+            if (entry_count == entry_capacity)
+            {
+                entry_capacity = entry_capacity ? entry_capacity * 2 : 1024;
+                uint32_t *new_names = realloc(names, entry_capacity * sizeof(*names));
+                if (new_names != NULL)
+                {
+                    names = new_names;
+                }
+                uint32_t *new_owners = realloc(owners, entry_capacity * sizeof(*owners));
+                if (new_owners != NULL)
+                {
+                    owners = new_owners;
+                }
+                if (new_names == NULL || new_owners == NULL)
+                {
+                    closedir(directory);
+                    goto cleanup;
+                }
+            }
+
+            names[entry_count] = path_index_add_string(&strings, &string_size, &string_capacity, directory_entry->d_name);
+            if (names[entry_count] == 0)
+            {
+                closedir(directory);
+                goto cleanup;
+            }
+            owners[entry_count++] = i;
+        }
+        closedir(directory);
+    }
+
+    // Keep the table at most half full so probes stay short
+    uint32_t slot_count = 16;
+    while (slot_count < entry_count * 2)
+    {
+        slot_count *= 2;
+    }
+
+    struct path_index_slot *slots = calloc(slot_count, sizeof(*slots));
+    if (slots == NULL)
+    {
+        goto cleanup;
+    }
+
+    uint32_t stored_count = 0;
+    for (size_t i = 0; i < entry_count; i++)
+    {
+        const char *name = strings + names[i];
+        uint32_t hash = hash_command_name(name);
+        uint32_t slot = hash & (slot_count - 1);
+
+        // Linear probing; the earliest PATH directory wins for duplicate names
+        while (slots[slot].name_offset != 0 &&
+               (slots[slot].hash != hash || strcmp(strings + slots[slot].name_offset, name)))
+        {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        if (slots[slot].name_offset == 0)
+        {
+            slots[slot].hash = hash;
+            slots[slot].name_offset = names[i];
+            slots[slot].directory = owners[i];
+            stored_count++;
+        }
+    }
+
+    struct path_index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PATH_INDEX_MAGIC, sizeof(header.magic));
+    header.version = PATH_INDEX_VERSION;
+    header.directory_count = path_count;
+    header.slot_count = slot_count;
+    header.entry_count = stored_count;
+    header.string_size = string_size;
+
+    // Write to a private temporary file, then rename it over the index so
+    // concurrent shells only ever map a complete file
+    char *temporary_path = malloc(strlen(PATH_INDEX.file_path) + 32);
+    if (temporary_path != NULL)
+    {
+        sprintf(temporary_path, "%s.%ld.tmp", PATH_INDEX.file_path, (long)getpid());
+        FILE *index_file = fopen(temporary_path, "w");
+        if (index_file != NULL)
+        {
+            bool written = fwrite(&header, sizeof(header), 1, index_file) == 1 &&
+                           fwrite(directories, sizeof(*directories), path_count, index_file) == path_count &&
+                           fwrite(slots, sizeof(*slots), slot_count, index_file) == slot_count &&
+                           fwrite(strings, 1, string_size, index_file) == string_size;
+            if (!fclose(index_file) && written && !rename(temporary_path, PATH_INDEX.file_path))
+            {
+                status = EXIT_SUCCESS;
+            }
+            else
+            {
+                unlink(temporary_path);
+            }
+        }
+        free(temporary_path);
+    }
+    free(slots);
+
+cleanup:
+    free(directories);
+    free(strings);
+    free(names);
+    free(owners);
+    return status;
+}
+
+/**
+ * Reads the modification time of a PATH directory
+ * @param directory The directory
+ * @return Its modification time, or zero if it doesn't exist
+ */
+struct timespec path_directory_mtime(const char *directory)
+{
+    struct stat directory_info;
+    struct timespec missing = {0, 0};
+    return stat(directory, &directory_info) ? missing : directory_info.st_mtim;
+}
+
+/**
+ * Remembers that the index couldn't be used with the current PATH
+ *
+ * The PATH generation and directory times are kept, so the index isn't
+ * tried again until one of them changes.
+ */
+void path_index_remember_failure()
+{
+    size_t count = 0;
+    while (PATH[count] != NULL)
+    {
+        count++;
+    }
+
+    struct timespec *mtimes = realloc(PATH_INDEX.failed_mtimes, (count > 0 ? count : 1) * sizeof(*mtimes));
+    if (mtimes == NULL)
+    {
+        return; // The next lookup simply tries again
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        mtimes[i] = path_directory_mtime(PATH[i]);
+    }
+    PATH_INDEX.failed_mtimes = mtimes;
+    PATH_INDEX.failed_count = count;
+    PATH_INDEX.failed_generation = PATH_GENERATION;
+    PATH_INDEX.failed = true;
+}
+
+/**
+ * Checks whether a remembered failure still applies
+ * @return true if neither PATH nor any of its directories changed since the
+ * index last failed
+ */
+bool path_index_failure_applies()
+{
+    if (!PATH_INDEX.failed || PATH_INDEX.failed_generation != PATH_GENERATION)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < PATH_INDEX.failed_count; i++)
+    {
+        struct timespec mtime = PATH[i] != NULL ? path_directory_mtime(PATH[i]) : PATH_INDEX.failed_mtimes[i];
+        if (PATH[i] == NULL || mtime.tv_sec != PATH_INDEX.failed_mtimes[i].tv_sec ||
+            mtime.tv_nsec != PATH_INDEX.failed_mtimes[i].tv_nsec)
+        {
+            return false;
+        }
+    }
+    return PATH[PATH_INDEX.failed_count] == NULL;
+}
+
+/**
+ * Makes sure the mapped index matches the current PATH, rebuilding it if a
+ * directory changed or the PATH list differs
+ * @return true if the index can be used for lookups
+ *
+ * A failed build or mapping is remembered until PATH or one of its
+ * directories changes, and directories that keep changing are rescanned at
+ * most once per PATH_INDEX_REBUILD_NS; lookups search PATH meanwhile.
+ */
+bool path_index_ready()
+{
+    if (PATH_INDEX.file_path == NULL)
+    {
+        return false;
+    }
+    if (PATH_INDEX.validated)
+    {
+        return true;
+    }
+
+    // An index that failed is only tried again once something changed
+    if (path_index_failure_applies())
+    {
+        return false;
+    }
+
+    // Another shell may already have rebuilt the index for this PATH
+    if (PATH_INDEX.map == NULL || !path_index_is_current())
+    {
+        if (path_index_map() || !path_index_is_current())
+        {
+            // While the directories keep changing, rebuild at most once per
+            // PATH_INDEX_REBUILD_NS and search PATH in between
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed_ns = (now.tv_sec - PATH_INDEX.rebuilt_at.tv_sec) * 1000000000L +
+                              (now.tv_nsec - PATH_INDEX.rebuilt_at.tv_nsec);
+            if ((PATH_INDEX.rebuilt_at.tv_sec != 0 || PATH_INDEX.rebuilt_at.tv_nsec != 0) &&
+                elapsed_ns < PATH_INDEX_REBUILD_NS)
+            {
+                return false;
+            }
+            PATH_INDEX.rebuilt_at = now;
+
+            if (path_index_build() || path_index_map())
+            {
+                // The index can't be used; fall back to searching PATH
+                path_index_unmap();
+                path_index_remember_failure();
+                return false;
+            }
+        }
+    }
+
+    PATH_INDEX.validated = true;
+    PATH_INDEX.failed = false;
+    return true;
+}
+
+/**
+ * Looks up a command in the PATH index
+ * @param command Command name to look up
+ * @param found Set to true if the index could answer the lookup
+ * @return Newly allocated full path (caller must free), or NULL if the command
+ * isn't in PATH or the index couldn't be used
+ */
+char *path_index_lookup(const char *command, bool *found)
+{
+    *found = false;
+    if (!path_index_ready())
+    {
+        return NULL;
+    }
+
+    const struct path_index_header *header = PATH_INDEX.map;
+    const struct path_index_slot *slots = path_index_slots();
+    const char *strings = path_index_strings();
+    uint32_t hash = hash_command_name(command);
+    uint32_t slot = hash & (header->slot_count - 1);
+
+    *found = true;
+    for (uint32_t probes = 0; probes < header->slot_count && slots[slot].name_offset != 0; probes++)
+    {
+        if (slots[slot].hash == hash && slots[slot].name_offset < header->string_size &&
+            !strcmp(strings + slots[slot].name_offset, command) &&
+            slots[slot].directory < header->directory_count)
+        {
+            const struct path_index_directory *directory = path_index_directories() + slots[slot].directory;
+            return create_executable_path((char *)strings + directory->name_offset, (char *)command);
+        }
+        slot = (slot + 1) & (header->slot_count - 1);
+    }
+    return NULL; // Not present in any PATH directory
+}
+
+/**
+ * Replaces the inotify watches with one per directory of the current PATH
+ *
+ * Called at startup and whenever the path builtin changes PATH. Without
+ * inotify support the shell keeps working, but only the path builtin and
+ * 'hash -r' invalidate remembered locations.
+ */
+void path_watcher_reset()
+{
+    if (PATH_WATCHER.inotify_fd == -1)
+    {
+        PATH_WATCHER.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (PATH_WATCHER.inotify_fd == -1)
+        {
+            return;
+        }
+    }
+
+    // Drop the watches of the previous PATH
+    for (size_t i = 0; i < PATH_WATCHER.watch_count; i++)
+    {
+        if (PATH_WATCHER.watch_descriptors[i] != -1)
+        {
+            inotify_rm_watch(PATH_WATCHER.inotify_fd, PATH_WATCHER.watch_descriptors[i]);
+        }
+    }
+    free(PATH_WATCHER.watch_descriptors);
+    PATH_WATCHER.watch_descriptors = NULL;
+    PATH_WATCHER.watch_count = 0;
+
+    size_t path_count = 0;
+    while (PATH[path_count] != NULL)
+    {
+        path_count++;
+    }
+    if (path_count == 0)
+    {
+        return;
+    }
+
+    PATH_WATCHER.watch_descriptors = malloc(path_count * sizeof(int));
+    if (PATH_WATCHER.watch_descriptors == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < path_count; i++)
+    {
+        // Missing directories can't be watched; they are simply skipped
+        PATH_WATCHER.watch_descriptors[i] = inotify_add_watch(PATH_WATCHER.inotify_fd, PATH[i], PATH_WATCH_EVENTS | IN_ONLYDIR);
+    }
+    PATH_WATCHER.watch_count = path_count;
+}
+
+/**
+ * Checks whether a watch descriptor belongs to the current PATH
+ * @param watch_descriptor Watch descriptor reported by an inotify event
+ * @return true if one of the current PATH directories uses it
+ */
+bool path_watcher_is_active(int watch_descriptor)
+{
+    for (size_t i = 0; i < PATH_WATCHER.watch_count; i++)
+    {
+        if (PATH_WATCHER.watch_descriptors[i] == watch_descriptor)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Applies pending inotify events to the lookup caches
+ *
+ * A change to a file only forgets the command of the same name; losing track
+ * of a directory (or of events) forgets everything. Any change also makes the
+ * PATH index revalidate against directory mtimes on its next use.
+ */
+void path_watcher_drain()
+{
+    // Buffer aligned for struct inotify_event, as required by inotify(7)
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t length;
+
+    if (PATH_WATCHER.inotify_fd == -1)
+    {
+        return;
+    }
+
+    while ((length = read(PATH_WATCHER.inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *position = buffer; position < buffer + length;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)position;
+            position += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                command_hash_clear();
+                PATH_INDEX.validated = false;
+                continue;
+            }
+
+            // Events for watches removed by a previous path change
+            if (!path_watcher_is_active(event->wd))
+            {
+                continue;
+            }
+
+            PATH_INDEX.validated = false;
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                command_hash_clear();
+            }
+            else if (event->len > 0)
+            {
+                command_hash_remove(event->name);
+            }
+        }
+    }
+}
+
+/**
+ * Finds the executable for a command, consulting the hash table first and the
+ * PATH index second
+ * @param command Command name to look up
+ * @return Full path of the executable (owned by the hash table), or NULL if
+ * the command wasn't found in any PATH directory
+ *
+ * Misses are remembered too, so repeatedly probing for a missing command is
+ * answered from the table until PATH or the directories change.
+ */
+const char *lookup_executable(char *command)
+{
+    // Forget locations invalidated by changes to the PATH directories
+    path_watcher_drain();
+
+    struct command_hash_entry *entry = command_hash_find(command);
+
+    // Entries resolved under a previous PATH are never trusted
+    if (entry != NULL && entry->generation != PATH_GENERATION)
+    {
+        command_hash_remove(command);
+        entry = NULL;
+    }
+
+    if (entry == NULL)
+    {
+        // Consult the shared PATH index before searching the directories
+        bool indexed;
+        char *executable_path = path_index_lookup(command, &indexed);
+        if (!indexed)
+        {
+            executable_path = resolve_executable(command);
+        }
+
+        entry = command_hash_insert(command, executable_path);
+        if (entry == NULL)
+        {
+            // Out of memory for the cache; report the command as unusable
+            free(executable_path);
+            return NULL;
+        }
+    }
+
+    entry->hits++;
+    return entry->path;
+}
+
+/**
+ * Adds a chunk to an arena
+ * @param arena The arena to grow
+ * @param minimum_size Smallest usable size the chunk must have
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ */
+int arena_add_chunk(struct arena *arena, size_t minimum_size)
+{
+    size_t capacity = arena->head ? arena->head->capacity * 2 : ARENA_INITIAL_CAPACITY;
+    while (capacity < minimum_size)
+    {
+        capacity *= 2;
+    }
+
+    struct arena_chunk *chunk = malloc(sizeof(*chunk) + capacity);
+    if (chunk == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    chunk->next = arena->head;
+    chunk->capacity = capacity;
+    chunk->used = 0;
+    arena->head = chunk;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Allocates memory from an arena
+ * @param arena The arena to allocate from
+ * @param size Number of bytes needed
+ * @return Pointer to the memory (valid until the next arena_reset), or NULL
+ * if memory couldn't be allocated
+ */
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+
+    if (arena->head == NULL || arena->head->capacity - arena->head->used < size)
+    {
+        if (arena_add_chunk(arena, size))
+        {
+            return NULL;
+        }
+    }
+
+    void *memory = arena->head->data + arena->head->used;
+    arena->head->used += size;
+    return memory;
+}
+
+/**
+ * Resizes the most recent allocation of an arena, or moves it if it can't grow
+ * in place
+ * @param arena The arena the memory came from
+ * @param memory Previous allocation (may be NULL)
+ * @param old_size Size of the previous allocation
+ * @param new_size Size needed now
+ * @return Pointer to the resized memory, or NULL if memory couldn't be
+ * allocated (the previous allocation is left untouched)
+ */
+void *arena_grow(struct arena *arena, void *memory, size_t old_size, size_t new_size)
+{
+    size_t aligned_old = (old_size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    size_t aligned_new = (new_size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    struct arena_chunk *chunk = arena->head;
+
+    // Extend in place when this was the last allocation and the chunk has room
+    if (memory != NULL && chunk != NULL && (char *)memory + aligned_old == chunk->data + chunk->used &&
+        chunk->capacity - (chunk->used - aligned_old) >= aligned_new)
+    {
+        chunk->used = chunk->used - aligned_old + aligned_new;
+        return memory;
+    }
+
+    void *new_memory = arena_alloc(arena, new_size);
+    if (new_memory != NULL && memory != NULL)
+    {
+        memcpy(new_memory, memory, old_size);
+    }
+    return new_memory;
+}
+
+/**
+ * Releases every allocation of an arena at once
+ * @param arena The arena to reset
+ *
+ * When the previous use needed more than one chunk, they are merged into a
+ * single chunk of the combined size, so an arena reused for similar work
+ * stops calling malloc altogether.
+ */
+void arena_reset(struct arena *arena)
+{
+    if (arena->head == NULL)
+    {
+        return;
+    }
+
+    if (arena->head->next == NULL)
+    {
+        arena->head->used = 0;
+        return;
+    }
+
+    size_t total_capacity = 0;
+    while (arena->head != NULL)
+    {
+        struct arena_chunk *chunk = arena->head;
+        arena->head = chunk->next;
+        total_capacity += chunk->capacity;
+        free(chunk);
+    }
+    // On failure the arena simply starts empty again
+    arena_add_chunk(arena, total_capacity);
+}
+
+/**
+ * Frees all memory owned by an arena
+ * @param arena The arena to release
+ */
+void arena_release(struct arena *arena)
+{
+    while (arena->head != NULL)
+    {
+        struct arena_chunk *chunk = arena->head;
+        arena->head = chunk->next;
+        free(chunk);
+    }
+}
+
+/**
+ * Inserts commands into the job queue of the current line, growing the job
+ * table as needed
+ * @param position Index the first new job gets; later jobs move back (only
+ * pending jobs may follow it)
+ * @param args NULL-terminated arguments of each new command
+ * @param count Number of commands to insert
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ */
+int job_table_insert(size_t position, char ***args, size_t count)
+{
+    if (JOBS.count + count > JOBS.capacity)
+    {
+        size_t new_capacity = JOBS.capacity ? JOBS.capacity * 2 : JOB_TABLE_INITIAL_CAPACITY;
+        while (new_capacity < JOBS.count + count)
+        {
+            new_capacity *= 2;
+        }
+        struct job *new_jobs = realloc(JOBS.jobs, new_capacity * sizeof(*new_jobs));
+        if (new_jobs == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        JOBS.jobs = new_jobs;
+        JOBS.capacity = new_capacity;
+    }
+
+    memmove(&JOBS.jobs[position + count], &JOBS.jobs[position], (JOBS.count - position) * sizeof(struct job));
+    JOBS.count += count;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        struct job *job = &JOBS.jobs[position + i];
+        job->args = args[i];
+        job->first_process = 0;
+        job->process_count = 0;
+        job->running_processes = 0;
+        job->status = 0;
+        job->state = JOB_PENDING;
+        job->open_outputs = 0;
+        job->batch_line = SIZE_MAX;
+        job->jobserver_token = -1;
+        job->affinity_unit = SIZE_MAX;
+        job->process_group = 0;
+        job->timeout_fd = -1;
+        job->timed_out = false;
+        memset(&job->started_at, 0, sizeof(job->started_at));
+        memset(&job->finished_at, 0, sizeof(job->finished_at));
+        memset(&job->usage, 0, sizeof(job->usage));
+        for (int stream = 0; stream < 2; stream++)
+        {
+            struct output_buffer *output = &job->output[stream];
+            output->read_fd = -1;
+            output->target_fd = STDOUT_FILENO + stream;
+            output->data = NULL;
+            output->length = 0;
+            output->capacity = 0;
+            output->spill_fd = -1;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Queues a command of the current line, growing the job table as needed
+ * @param args NULL-terminated arguments of the command
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ */
+int job_table_add(char **args)
+{
+    return job_table_insert(JOBS.count, &args, 1);
+}
+
+/**
+ * Measures the redirection operator at the start of a string
+ * @param text Text starting at a token boundary
+ * @return Length of the operator, or 0 if the text doesn't start with one
+ *
+ * Recognised forms are '<', '>', '>>', '&>', '&>>' and '>&M', each optionally
+ * preceded by a descriptor number ('2>', '2>>', '0<', '2>&1'). A number is
+ * only part of the operator when '<' or '>' follows it immediately, so
+ * "echo 2 > file" still passes "2" as an argument.
+ */
+size_t redirection_operator_length(const char *text)
+{
+    const char *current = text;
+
+    if (current[0] == PARALLEL_DELIM[0] && current[1] == REDIRECTION_DELIM[0])
+    {
+        // '&>' and '&>>' send both standard output and standard error
+        current += 2;
+        return current[0] == REDIRECTION_DELIM[0] ? 3 : 2;
+    }
+
+    while (*current >= '0' && *current <= '9')
+    {
+        current++;
+    }
+
+    if (*current == INPUT_REDIRECTION_DELIM[0])
+    {
+        return current - text + 1;
+    }
+    if (*current != REDIRECTION_DELIM[0])
+    {
+        return 0;
+    }
+
+    current++;
+    if (*current == REDIRECTION_DELIM[0])
+    {
+        current++;
+    }
+    else if (*current == PARALLEL_DELIM[0] && current[1] >= '0' && current[1] <= '9')
+    {
+        // '>&M' duplicates descriptor M; a bare '>&' is '>' followed by '&'
+        current++;
+        while (*current >= '0' && *current <= '9')
+        {
+            current++;
+        }
+    }
+    return current - text;
+}
+
+/**
+ * Checks whether an argument is a redirection operator token
+ * @param arg Argument produced by parse_line
+ * @return true if the whole argument is a redirection operator
+ */
+bool is_redirection_operator(const char *arg)
+{
+    size_t length = redirection_operator_length(arg);
+    return length != 0 && arg[length] == '\0';
+}
+
+/**
+ * Parses a descriptor number at the start of an operator
+ * @param text Text starting with the digits
+ * @param fd Set to the descriptor number
+ * @return Pointer to the first character after the digits, or NULL if the
+ * number is not below the descriptor limit (RLIMIT_NOFILE)
+ */
+const char *parse_redirection_fd(const char *text, int *fd)
+{
+    char *end;
+    struct rlimit limit;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (errno || value > INT_MAX ||
+        (!getrlimit(RLIMIT_NOFILE, &limit) && limit.rlim_cur != RLIM_INFINITY && (rlim_t)value >= limit.rlim_cur))
+    {
+        return NULL;
+    }
+    *fd = (int)value;
+    return end;
+}
+
+/**
+ * Adds a redirection to a list, rejecting a second redirection of the same
+ * descriptor
+ * @param redirections List with room for the new redirection
+ * @param redirection Redirection to add
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the descriptor is already
+ * redirected
+ */
+int add_redirection(struct redirection_list *redirections, struct redirection redirection)
+{
+    for (size_t i = 0; i < redirections->count; i++)
+    {
+        if (redirections->items[i].fd == redirection.fd)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    redirections->items[redirections->count++] = redirection;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Locates and validates the redirections in command arguments
+ * @param args Array of command arguments (left unmodified)
+ * @param redirections Set to the command's redirections, allocated from
+ * LINE_ARENA; position is -1 if the command has none
+ * @return EXIT_SUCCESS if the redirections are well formed, EXIT_FAILURE
+ * otherwise
+ *
+ * Redirections follow all of the command's words. Every operator except
+ * 'N>&M' takes a file name, and no descriptor may be redirected twice.
+ */
+int parse_redirections(char **args, struct redirection_list *redirections)
+{
+    int current_position = 0;
+    redirections->items = NULL;
+    redirections->count = 0;
+    redirections->position = -1;
+
+    // Search through arguments for the first redirection operator
+    while (args[current_position] != NULL && !is_redirection_operator(args[current_position]))
+    {
+        current_position++;
+    }
+    if (args[current_position] == NULL)
+    {
+        return EXIT_SUCCESS;
+    }
+
+    // Error case: redirection at start of command (e.g., "> file")
+    if (current_position == 0)
+    {
+        return EXIT_FAILURE;
+    }
+    redirections->position = current_position;
+
+    // '&>' expands to two redirections, so size the list for the worst case
+    int remaining = 0;
+    while (args[current_position + remaining] != NULL)
+    {
+        remaining++;
+    }
+    redirections->items = arena_alloc(&LINE_ARENA, 2 * remaining * sizeof(struct redirection));
+    if (redirections->items == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    while (args[current_position] != NULL)
+    {
+        const char *operator = args[current_position];
+
+        // Error case: a word after the redirections (e.g., "ls > file1 file2")
+        if (!is_redirection_operator(operator))
+        {
+            return EXIT_FAILURE;
+        }
+
+        struct redirection redirection = {REDIRECT_OPEN, STDOUT_FILENO, 0, NULL, -1};
+        bool both_outputs = operator[0] == PARALLEL_DELIM[0];
+        if (both_outputs)
+        {
+            operator++;
+        }
+        else if (operator[0] >= '0' && operator[0] <= '9')
+        {
+            operator = parse_redirection_fd(operator, &redirection.fd);
+            if (operator == NULL)
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else if (operator[0] == INPUT_REDIRECTION_DELIM[0])
+        {
+            redirection.fd = STDIN_FILENO;
+        }
+
+        if (operator[0] == INPUT_REDIRECTION_DELIM[0])
+        {
+            redirection.flags = O_RDONLY;
+        }
+        else if (operator[1] == REDIRECTION_DELIM[0])
+        {
+            redirection.flags = O_WRONLY | O_CREAT | O_APPEND;
+        }
+        else if (operator[1] == PARALLEL_DELIM[0])
+        {
+            redirection.kind = REDIRECT_DUP;
+            if (parse_redirection_fd(operator + 2, &redirection.source_fd) == NULL)
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        else
+        {
+            redirection.flags = O_WRONLY | O_CREAT | O_TRUNC;
+        }
+        current_position++;
+
+        if (redirection.kind == REDIRECT_OPEN)
+        {
+            // Error case: missing filename (e.g., "ls >" or "ls > > file")
+            if (args[current_position] == NULL || is_redirection_operator(args[current_position]))
+            {
+                return EXIT_FAILURE;
+            }
+            redirection.path = args[current_position++];
+        }
+
+        // Error case: the same descriptor twice (e.g., "ls > file1 > file2")
+        if (add_redirection(redirections, redirection))
+        {
+            return EXIT_FAILURE;
+        }
+
+        if (both_outputs)
+        {
+            struct redirection error_copy = {REDIRECT_DUP, STDERR_FILENO, 0, NULL, STDOUT_FILENO};
+            if (add_redirection(redirections, error_copy))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Applies a command's redirections to the calling process
+ * @param args Array of command arguments; the redirection tokens are removed
+ * @param redirections Redirections parsed by parse_redirections
+ * @return EXIT_SUCCESS if every redirection was applied, EXIT_FAILURE otherwise
+ *
+ * Only meant for a forked child, since the shell's own descriptors change.
+ */
+int apply_redirections(char **args, const struct redirection_list *redirections)
+{
+    // Remove the redirection tokens and file names from arguments
+    if (redirections->position != -1)
+    {
+        args[redirections->position] = NULL;
+    }
+
+    for (size_t i = 0; i < redirections->count; i++)
+    {
+        const struct redirection *redirection = &redirections->items[i];
+
+        if (redirection->kind == REDIRECT_DUP)
+        {
+            // 'N>&N' keeps the descriptor, but it still has to be open
+            int result = redirection->source_fd == redirection->fd
+                             ? fcntl(redirection->fd, F_GETFD)
+                             : dup2(redirection->source_fd, redirection->fd);
+            if (result == -1)
+            {
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+
+        // Open the file (created with 0644 when written to)
+        int file_descriptor = open(redirection->path, redirection->flags, 0644);
+        if (file_descriptor == -1)
+        {
+            return EXIT_FAILURE;
+        }
+
+        // Move it to the redirected descriptor
+        if (file_descriptor != redirection->fd)
+        {
+            int result = dup2(file_descriptor, redirection->fd);
+            close(file_descriptor);
+            if (result == -1)
+            {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Forgets every lookup made under the current PATH
+ *
+ * Remembered locations and misses are dropped, the PATH index is checked
+ * again before its next use and the directories are watched anew.
+ */
+void path_invalidate()
+{
+    PATH_GENERATION++;
+    command_hash_clear();
+    PATH_INDEX.validated = false;
+    path_watcher_reset();
+}
+
+/**
+ * Checks whether a PATH directory is relative to the working directory
+ * @return true if any PATH entry doesn't start with '/'
+ */
+bool path_has_relative_entry()
+{
+    for (size_t i = 0; PATH[i] != NULL; i++)
+    {
+        if (PATH[i][0] != '/')
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Executes the built-in 'cd' (change directory) command
+ * @param args Array of command arguments where args[0] is "cd" and args[1] is
+ * the target directory
+ * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ */
+int execute_cd(char **args)
+{
+    if (!strcmp(args[0], "cd"))
+    {
+        int arg_count = 0;
+        // Count the number of arguments
+        while (args[arg_count] != NULL)
+        {
+            arg_count++;
+        }
+        // Check if exactly one argument was provided (cd + directory)
+        if (arg_count == 2)
+        {
+            // Attempt to change directory and report error if it fails
+            if (chdir(args[1]) != 0)
+            {
+                fprintf(ERROUTPUT, ERROR_MSG);
+            }
+            else if (path_has_relative_entry())
+            {
+                // Relative PATH entries now name other directories, which
+                // inotify doesn't know about
+                path_invalidate();
+            }
+        }
+        else
+        {
+            // Wrong number of arguments for cd command
+            fprintf(ERROUTPUT, ERROR_MSG);
+        }
+        return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * Executes the built-in 'exit' command
+ * @param args Array of command arguments where args[0] is "exit"
+ * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ */
+int execute_exit(char **args)
+{
+    // Check if command is "exit"
+    if (!strcmp(args[0], "exit"))
+    {
+        if (args[1] != NULL)
+        {
+            // Error: exit command should not have any arguments
+            fprintf(stderr, ERROR_MSG);
+            return EXIT_SUCCESS;
+        }
+        else
+        {
+            // Exit the shell with success status
+            exit(EXIT_SUCCESS);
+        }
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * Executes the built-in 'path' command to set search directories
+ * @param args Array of command arguments where args[0] is "path" followed by
+ * directory paths
+ * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ */
+int execute_path(char **args)
+{
+    if (!strcmp(args[0], "path"))
+    {
+        // First, clear the existing path by setting all entries to NULL
+        int path_count = 0;
+        while (PATH[path_count] != NULL)
+        {
+            free(PATH[path_count]); // Free the previously allocated memory
+            PATH[path_count] = NULL;
+            path_count++;
+        }
+
+        // Make room for every directory given (PATH always has room for the
+        // terminator, so it stays empty if this fails)
+        path_count = 0;
+        int directory_count = 0;
+        while (args[directory_count + 1] != NULL)
+        {
+            directory_count++;
+        }
+        if (path_reserve(directory_count))
+        {
+            fprintf(ERROUTPUT, ERROR_MSG);
+            directory_count = 0;
+        }
+
+        // If there are arguments, add each one to the PATH array
+        if (directory_count > 0)
+        {
+            int args_count = 1;
+            while (args[args_count] != NULL)
+            {
+                // Create a copy of the path string to avoid issues when args memory is
+                // freed
+                PATH[path_count] = strdup(args[args_count]);
+                path_count++;
+                args_count++;
+            }
+        }
+
+        // Ensure the PATH array is NULL-terminated
+        PATH[path_count] = NULL;
+
+        // Remembered locations and misses are no longer valid with the new path
+        path_invalidate();
+        return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * Executes the built-in 'hash' command to inspect the command hash table
+ * @param args Array of command arguments where args[0] is "hash"
+ * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ *
+ * Forms accepted:
+ * - hash: List the remembered commands with their hit counts
+ * - hash -r: Forget all remembered locations
+ * - hash name...: Look up each command and remember its location
+ */
+int execute_hash(char **args)
+{
+    if (!strcmp(args[0], "hash"))
+    {
+        if (args[1] == NULL)
+        {
+            // List the table in the same layout as bash; remembered misses
+            // are not shown
+            bool header_printed = false;
+            for (size_t i = 0; i < COMMAND_HASH.bucket_count; i++)
+            {
+                for (struct command_hash_entry *entry = COMMAND_HASH.buckets[i]; entry != NULL; entry = entry->next)
+                {
+                    if (entry->path == NULL)
+                    {
+                        continue;
+                    }
+                    if (!header_printed)
+                    {
+                        fprintf(OUTPUT, "hits\tcommand\n");
+                        header_printed = true;
+                    }
+                    fprintf(OUTPUT, "%4u\t%s\n", entry->hits, entry->path);
+                }
+            }
+            if (!header_printed)
+            {
+                fprintf(OUTPUT, "hash: hash table empty\n");
+            }
+            fflush(OUTPUT);
+        }
+        else if (!strcmp(args[1], "-r") && args[2] == NULL)
+        {
+            command_hash_clear();
+        }
+        else
+        {
+            for (int i = 1; args[i] != NULL; i++)
+            {
+                // Resolve without counting it as a use of the command
+                bool known = command_hash_find(args[i]) != NULL;
+                const char *executable_path = lookup_executable(args[i]);
+                struct command_hash_entry *entry = command_hash_find(args[i]);
+                if (entry != NULL)
+                {
+                    entry->hits = known ? entry->hits - 1 : 0;
+                }
+                if (executable_path == NULL)
+                {
+                    fprintf(ERROUTPUT, ERROR_MSG);
+                }
+            }
+        }
+        return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * Parses a job limit given on the command line or to jobs-limit
+ * @param text Decimal number of jobs, 0 meaning unlimited
+ * @param limit Set to the parsed value on success
+ * @return EXIT_SUCCESS if the number is valid, EXIT_FAILURE otherwise
+ */
+int parse_jobs_limit(const char *text, size_t *limit)
+{
+    char *end;
+    unsigned long long value;
+
+    if (text[0] < '0' || text[0] > '9')
+    {
+        return EXIT_FAILURE;
+    }
+    value = strtoull(text, &end, 10);
+    if (*end != '\0')
+    {
+        return EXIT_FAILURE;
+    }
+    *limit = (size_t)value;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Executes the built-in 'jobs-limit' command to show or set the job limit
+ * @param args Array of command arguments where args[0] is "jobs-limit" and
+ * args[1], if present, is the new limit (0 for no limit)
+ * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ */
+int execute_jobs_limit(char **args)
+{
+    if (!strcmp(args[0], "jobs-limit"))
+    {
+        if (args[1] == NULL)
+        {
+            fprintf(OUTPUT, "%zu\n", JOBS_LIMIT);
+            fflush(OUTPUT);
+        }
+        else if (args[2] != NULL || parse_jobs_limit(args[1], &JOBS_LIMIT))
+        {
+            fprintf(ERROUTPUT, ERROR_MSG);
+        }
+        return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * Parses a load limit (a load average or a pressure percentage)
+ * @param text Text to parse
+ * @param limit Set to the parsed limit
+ * @return EXIT_SUCCESS if text is a non-negative number, EXIT_FAILURE otherwise
+ */
+int parse_load_limit(const char *text, double *limit)
+{
+    char *end;
+
+    if ((text[0] < '0' || text[0] > '9') && text[0] != '.')
+    {
+        return EXIT_FAILURE;
+    }
+    double value = strtod(text, &end);
+    if (*end != '\0' || !(value < 1e9))
+    {
+        return EXIT_FAILURE;
+    }
+    *limit = value;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Executes the built-in 'load-limit' command to show or set the load limits
+ * @param args Array of command arguments where args[0] is "load-limit",
+ * followed by pairs of "load", "cpu" or "memory" and the new limit (0 to
+ * ignore it)
+ * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ */
+int execute_load_limit(char **args)
+{
+    if (strcmp(args[0], "load-limit"))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (args[1] == NULL)
+    {
+        fprintf(OUTPUT, "load %g cpu %g memory %g\n", LOAD.max_load, LOAD.max_cpu_pressure,
+                LOAD.max_memory_pressure);
+        fflush(OUTPUT);
+        return EXIT_SUCCESS;
+    }
+
+    // Validate every pair before changing anything
+    struct load_limits limits = LOAD;
+    for (int i = 1; args[i] != NULL; i += 2)
+    {
+        double *limit = !strcmp(args[i], "load")     ? &limits.max_load
+                        : !strcmp(args[i], "cpu")    ? &limits.max_cpu_pressure
+                        : !strcmp(args[i], "memory") ? &limits.max_memory_pressure
+                                                     : NULL;
+        if (limit == NULL || args[i + 1] == NULL || parse_load_limit(args[i + 1], limit))
+        {
+            fprintf(ERROUTPUT, ERROR_MSG);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    LOAD.max_load = limits.max_load;
+    LOAD.max_cpu_pressure = limits.max_cpu_pressure;
+    LOAD.max_memory_pressure = limits.max_memory_pressure;
+    LOAD.checked_at.tv_sec = 0; // Take fresh readings for the next job
+    LOAD.checked_at.tv_nsec = 0;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Parses a time limit such as "30", "1.5s", "2m", "1h" or "1d"
+ * @param text Number of seconds, optionally followed by a unit
+ * @param seconds Set to the limit in seconds, 0 meaning no limit
+ * @return EXIT_SUCCESS if text is a valid duration, EXIT_FAILURE otherwise
+ */
+int parse_duration(const char *text, double *seconds)
+{
+    char *end;
+
+    if ((text[0] < '0' || text[0] > '9') && text[0] != '.')
+    {
+        return EXIT_FAILURE;
+    }
+    double value = strtod(text, &end);
+    double unit = !strcmp(end, "") || !strcmp(end, "s") ? 1
+                  : !strcmp(end, "m")                  ? 60
+                  : !strcmp(end, "h")                  ? 60 * 60
+                  : !strcmp(end, "d")                  ? 24 * 60 * 60
+                                                       : 0;
+    if (unit == 0 || !(value * unit < 1e9))
+    {
+        return EXIT_FAILURE;
+    }
+    *seconds = value * unit;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Writes the usage of one command as a line of "key=value" fields
+ * @param file_descriptor Descriptor to write to
+ * @param usage The command's usage
+ */
+void write_command_usage(int file_descriptor, const struct command_usage *usage)
+{
+    char status[32];
+    if (usage->timed_out)
+    {
+        snprintf(status, sizeof(status), "timeout");
+    }
+    else if (WIFSIGNALED(usage->status))
+    {
+        snprintf(status, sizeof(status), "signal:%d", WTERMSIG(usage->status));
+    }
+    else
+    {
+        snprintf(status, sizeof(status), "%d", WEXITSTATUS(usage->status));
+    }
+
+    dprintf(file_descriptor, "real=%.3f user=%.3f sys=%.3f maxrss=%ldk vcsw=%ld ivcsw=%ld status=%s command=%s\n",
+            usage->real_seconds, usage->user_seconds, usage->system_seconds, usage->max_rss_kb,
+            usage->voluntary_switches, usage->involuntary_switches, status, usage->command);
+}
+
+/**
+ * Executes the built-in 'times' command to show the CPU time used
+ * @param args Array of command arguments where args[0] is "times"
+ * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ *
+ * Like the POSIX built-in, prints the user and system time of the shell and
+ * of all its children; then the usage of each command of the last line
+ * that ran any.
+ */
+int execute_times(char **args)
+{
+    if (strcmp(args[0], "times"))
+    {
+        return EXIT_FAILURE;
+    }
+    if (args[1] != NULL)
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_SUCCESS;
+    }
+
+    struct rusage self;
+    struct rusage children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    const struct rusage *usages[] = {&self, &children};
+    for (int i = 0; i < 2; i++)
+    {
+        const struct timeval *user = &usages[i]->ru_utime;
+        const struct timeval *system = &usages[i]->ru_stime;
+        fprintf(OUTPUT, "%ldm%ld.%03lds %ldm%ld.%03lds\n", (long)user->tv_sec / 60, (long)user->tv_sec % 60,
+                (long)user->tv_usec / 1000, (long)system->tv_sec / 60, (long)system->tv_sec % 60,
+                (long)system->tv_usec / 1000);
+    }
+
+    // The records go straight to the descriptor, after what is buffered
+    fflush(OUTPUT);
+    for (size_t i = 0; i < USAGE.count; i++)
+    {
+        write_command_usage(fileno(OUTPUT), &USAGE.records[i]);
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Computes the time between two readings of the monotonic clock
+ * @param start Earlier reading
+ * @param end Later reading
+ * @return Nanoseconds from start to end, 0 if end is earlier
+ */
+uint64_t elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    int64_t elapsed = (int64_t)(end->tv_sec - start->tv_sec) * 1000000000 + (end->tv_nsec - start->tv_nsec);
+    return elapsed > 0 ? (uint64_t)elapsed : 0;
+}
+
+/**
+ * Finds the histogram bucket of a value
+ * @param value Value to record
+ * @return Index of the bucket
+ */
+size_t histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+    {
+        return (size_t)value;
+    }
+    int exponent = 63 - __builtin_clzll(value);
+    int shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+    return (size_t)(shift + 1) * HISTOGRAM_SUB_BUCKETS + (size_t)((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+/**
+ * Finds the value a histogram bucket stands for
+ * @param index Index of the bucket
+ * @return The middle of the values recorded in the bucket
+ */
+uint64_t histogram_bucket_value(size_t index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS)
+    {
+        return index;
+    }
+    int shift = (int)(index / HISTOGRAM_SUB_BUCKETS) - 1;
+    uint64_t lowest = (uint64_t)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+    return lowest + ((1ULL << shift) >> 1);
+}
+
+/**
+ * Adds a value to a histogram
+ * @param histogram The histogram
+ * @param value Duration in nanoseconds
+ */
+void histogram_record(struct histogram *histogram, uint64_t value)
+{
+    histogram->counts[histogram_bucket(value)]++;
+    histogram->min = histogram->total == 0 || value < histogram->min ? value : histogram->min;
+    histogram->max = value > histogram->max ? value : histogram->max;
+    histogram->total++;
+    histogram->sum += value;
+}
+
+/**
+ * Records the time from a reading of the monotonic clock until now
+ * @param histogram The histogram
+ * @param start Earlier reading
+ */
+void histogram_record_since(struct histogram *histogram, const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    histogram_record(histogram, elapsed_ns(start, &now));
+}
+
+/**
+ * Finds the value below which a given share of the recorded values fall
+ * @param histogram The histogram (not empty)
+ * @param percentile Share in percent, e.g. 99.9
+ * @return The value, within the precision of its bucket
+ */
+uint64_t histogram_percentile(const struct histogram *histogram, double percentile)
+{
+    uint64_t rank = (uint64_t)(percentile / 100 * (double)histogram->total + 0.5);
+    rank = rank < 1 ? 1 : rank;
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->counts[i];
+        if (seen >= rank)
+        {
+            uint64_t value = histogram_bucket_value(i);
+            return value < histogram->min ? histogram->min : value > histogram->max ? histogram->max : value;
+        }
+    }
+    return histogram->max;
+}
+
+/**
+ * Formats a duration with a readable unit
+ * @param nanoseconds The duration
+ * @param buffer Set to the text, e.g. "850ns", "12.3us", "4.56ms", "1.23s"
+ * @param size Size of buffer
+ */
+void format_duration(uint64_t nanoseconds, char *buffer, size_t size)
+{
+    if (nanoseconds < 1000)
+    {
+        snprintf(buffer, size, "%luns", (unsigned long)nanoseconds);
+    }
+    else if (nanoseconds < 1000000)
+    {
+        snprintf(buffer, size, "%.3gus", (double)nanoseconds / 1e3);
+    }
+    else if (nanoseconds < 1000000000)
+    {
+        snprintf(buffer, size, "%.3gms", (double)nanoseconds / 1e6);
+    }
+    else
+    {
+        snprintf(buffer, size, "%.3fs", (double)nanoseconds / 1e9);
+    }
+}
+
+/**
+ * Prints the counters and the percentiles of each histogram
+ * @param stream Stream to print to
+ */
+void print_stats(FILE *stream)
+{
+    static const double percentiles[] = {50, 90, 99, 99.9};
+    const struct histogram *histograms[] = {&STATS.dispatch, &STATS.spawn, &STATS.runtime};
+    const char *names[] = {"dispatch", "spawn", "runtime"};
+
+    fprintf(stream, "lines %lu commands %lu builtins %lu lookup-failures %lu exec-failures %lu\n",
+            (unsigned long)STATS.lines, (unsigned long)STATS.commands, (unsigned long)STATS.builtins,
+            (unsigned long)STATS.lookup_failures, (unsigned long)STATS.exec_failures);
+
+    for (size_t i = 0; i < sizeof(histograms) / sizeof(histograms[0]); i++)
+    {
+        const struct histogram *histogram = histograms[i];
+        char value[32];
+        fprintf(stream, "%s count %lu", names[i], (unsigned long)histogram->total);
+        if (histogram->total > 0)
+        {
+            format_duration(histogram->min, value, sizeof(value));
+            fprintf(stream, " min %s", value);
+            format_duration(histogram->sum / histogram->total, value, sizeof(value));
+            fprintf(stream, " mean %s", value);
+            for (size_t j = 0; j < sizeof(percentiles) / sizeof(percentiles[0]); j++)
+            {
+                format_duration(histogram_percentile(histogram, percentiles[j]), value, sizeof(value));
+                fprintf(stream, " p%g %s", percentiles[j], value);
+            }
+            format_duration(histogram->max, value, sizeof(value));
+            fprintf(stream, " max %s", value);
+        }
+        fprintf(stream, "\n");
+    }
+    fflush(stream);
+}
+
+/**
+ * Prints the statistics to standard error when the shell exits (registered
+ * with atexit() for --stats-on-exit, so the 'exit' built-in is covered too)
+ */
+void print_stats_on_exit()
+{
+    print_stats(stderr);
+}
+
+/**
+ * Executes the built-in 'stats' command to show the shell's statistics
+ * @param args Array of command arguments where args[0] is "stats"
+ * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ */
+int execute_stats(char **args)
+{
+    if (strcmp(args[0], "stats"))
+    {
+        return EXIT_FAILURE;
+    }
+    if (args[1] != NULL)
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_SUCCESS;
+    }
+    print_stats(OUTPUT);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Checks whether a descriptor can be the target of splice()
+ * @param file_descriptor Descriptor to check
+ * @return true for pipes and for regular files not opened in append mode
+ */
+bool splice_target(int file_descriptor)
+{
+    struct stat file_info;
+    if (fstat(file_descriptor, &file_info))
+    {
+        return false;
+    }
+    if (S_ISFIFO(file_info.st_mode))
+    {
+        return true;
+    }
+    return S_ISREG(file_info.st_mode) && !(fcntl(file_descriptor, F_GETFL) & O_APPEND);
+}
+
+/**
+ * Checks whether a descriptor refers to a pipe
+ * @param file_descriptor Descriptor to check
+ * @return true if it is a pipe or FIFO
+ */
+bool is_pipe(int file_descriptor)
+{
+    struct stat file_info;
+    return !fstat(file_descriptor, &file_info) && S_ISFIFO(file_info.st_mode);
+}
+
+/**
+ * Writes a whole buffer, retrying after partial writes
+ * @param file_descriptor Descriptor to write to
+ * @param buffer Data to write
+ * @param length Number of bytes to write
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on a write error
+ */
+int write_all(int file_descriptor, const char *buffer, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t written = write(file_descriptor, buffer, length);
+        if (written <= 0)
+        {
+            return EXIT_FAILURE;
+        }
+        buffer += written;
+        length -= written;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Keeps the shell alive when it writes to a pipe whose reader is gone
+ *
+ * SIGPIPE is blocked once, on first use, so such writes fail with EPIPE
+ * instead; the signal then stays pending and is never delivered. Children
+ * get the shell's original mask (EVENTS.child_mask) back, so they still
+ * die on SIGPIPE.
+ */
+void ignore_sigpipe()
+{
+    static bool blocked = false;
+
+    if (!blocked)
+    {
+        sigset_t pipe_signal;
+        sigemptyset(&pipe_signal);
+        sigaddset(&pipe_signal, SIGPIPE);
+        blocked = !sigprocmask(SIG_BLOCK, &pipe_signal, NULL);
+    }
+}
+
+/**
+ * Moves exactly a number of bytes with splice(), retrying partial transfers
+ * @param input_fd Descriptor to read from (one side must be a pipe)
+ * @param output_fd Descriptor to write to
+ * @param length Number of bytes to move
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on error
+ */
+int splice_all(int input_fd, int output_fd, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t moved = splice(input_fd, NULL, output_fd, NULL, length, SPLICE_F_MOVE);
+        if (moved <= 0)
+        {
+            return EXIT_FAILURE;
+        }
+        length -= moved;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Copies everything from one descriptor to another until end of input
+ * @param input_fd Descriptor to read from
+ * @param output_fd Descriptor to write to
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on error
+ *
+ * Data stays in the kernel whenever possible: splice() when either side is
+ * a pipe, copy_file_range() between regular files and sendfile() from a
+ * regular file. Plain read/write is the last resort.
+ */
+int stream_copy(int input_fd, int output_fd)
+{
+    struct stat input_info;
+    ssize_t moved;
+
+    if (fstat(input_fd, &input_info))
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (S_ISFIFO(input_info.st_mode) || is_pipe(output_fd))
+    {
+        while ((moved = splice(input_fd, NULL, output_fd, NULL, STREAM_CHUNK, SPLICE_F_MOVE)) > 0)
+        {
+        }
+        if (moved == 0)
+        {
+            return EXIT_SUCCESS;
+        }
+        if (errno != EINVAL)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    else if (S_ISREG(input_info.st_mode))
+    {
+        while ((moved = copy_file_range(input_fd, NULL, output_fd, NULL, SSIZE_MAX, 0)) > 0)
+        {
+        }
+        if (moved == 0)
+        {
+            return EXIT_SUCCESS;
+        }
+
+        // Not two regular files on a supporting file system: try sendfile
+        while ((moved = sendfile(output_fd, input_fd, NULL, STREAM_CHUNK)) > 0)
+        {
+        }
+        if (moved == 0)
+        {
+            return EXIT_SUCCESS;
+        }
+        if (errno != EINVAL && errno != ENOSYS)
+        {
+            return EXIT_FAILURE;
+        }
+    }
+
+    char buffer[STREAM_CHUNK];
+    while ((moved = read(input_fd, buffer, sizeof(buffer))) > 0)
+    {
+        if (write_all(output_fd, buffer, moved))
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    return moved == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Copies everything from one descriptor to several others until end of input
+ * @param input_fd Descriptor to read from
+ * @param outputs Descriptors to write to
+ * @param output_count Number of outputs (at least one)
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on error
+ *
+ * When the input is a pipe and every output accepts splice(), each chunk is
+ * duplicated with tee() into a scratch pipe for all but the last output and
+ * finally spliced into the last one, so the data never enters user space.
+ */
+int stream_tee(int input_fd, int *outputs, size_t output_count)
+{
+    if (output_count == 1)
+    {
+        return stream_copy(input_fd, outputs[0]);
+    }
+
+    bool zero_copy = is_pipe(input_fd);
+    for (size_t i = 0; zero_copy && i < output_count; i++)
+    {
+        zero_copy = splice_target(outputs[i]);
+    }
+
+    int scratch[2];
+    if (zero_copy && !pipe2(scratch, O_CLOEXEC))
+    {
+        int status = EXIT_SUCCESS;
+        for (;;)
+        {
+            // The first tee() decides the chunk size; the input keeps the data
+            ssize_t chunk = tee(input_fd, scratch[1], STREAM_CHUNK, 0);
+            if (chunk <= 0)
+            {
+                status = chunk == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+                break;
+            }
+            if (splice_all(scratch[0], outputs[0], chunk))
+            {
+                status = EXIT_FAILURE;
+                break;
+            }
+            for (size_t i = 1; i < output_count - 1 && status == EXIT_SUCCESS; i++)
+            {
+                if (tee(input_fd, scratch[1], chunk, 0) != chunk || splice_all(scratch[0], outputs[i], chunk))
+                {
+                    status = EXIT_FAILURE;
+                }
+            }
+
+            // The last output consumes the chunk from the input
+            if (status || splice_all(input_fd, outputs[output_count - 1], chunk))
+            {
+                status = EXIT_FAILURE;
+                break;
+            }
+        }
+        close(scratch[0]);
+        close(scratch[1]);
+        return status;
+    }
+
+    char buffer[STREAM_CHUNK];
+    ssize_t length;
+    while ((length = read(input_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (size_t i = 0; i < output_count; i++)
+        {
+            if (write_all(outputs[i], buffer, length))
+            {
+                return EXIT_FAILURE;
+            }
+        }
+    }
+    return length == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Reads the clock used for trace events
+ * @return The current monotonic time, or zero when not tracing
+ */
+struct timespec trace_clock()
+{
+    struct timespec now = {0, 0};
+    if (TRACE.fd != -1)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    }
+    return now;
+}
+
+/**
+ * Writes out the collected trace events
+ *
+ * If the trace file can't be written, tracing stops.
+ */
+void trace_flush()
+{
+    if (TRACE.length > 0 && write_all(TRACE.fd, TRACE.buffer, TRACE.length))
+    {
+        close(TRACE.fd);
+        TRACE.fd = -1;
+        fprintf(ERROUTPUT, ERROR_MSG);
+    }
+    TRACE.length = 0;
+}
+
+/**
+ * Appends text to the trace buffer, writing the buffer out when it is full
+ * @param text Text to append (at most TRACE_BUFFER_SIZE bytes)
+ * @param length Length of text
+ */
+void trace_append(const char *text, size_t length)
+{
+    if (TRACE.length + length > TRACE_BUFFER_SIZE)
+    {
+        trace_flush();
+    }
+    if (TRACE.fd != -1)
+    {
+        memcpy(TRACE.buffer + TRACE.length, text, length);
+        TRACE.length += length;
+    }
+}
+
+/**
+ * Copies text into a JSON string body, escaping what JSON requires
+ * @param destination Buffer of at least TRACE_TEXT_LENGTH * 6 + 1 bytes
+ * @param text Text to copy; only its first TRACE_TEXT_LENGTH bytes are kept
+ */
+void trace_escape(char *destination, const char *text)
+{
+    size_t length = 0;
+    for (size_t i = 0; text[i] != '\0' && i < TRACE_TEXT_LENGTH; i++)
+    {
+        unsigned char character = (unsigned char)text[i];
+        if (character == '"' || character == '\\')
+        {
+            destination[length++] = '\\';
+            destination[length++] = (char)character;
+        }
+        else if (character < 0x20)
+        {
+            length += sprintf(destination + length, "\\u%04x", character);
+        }
+        else
+        {
+            destination[length++] = (char)character;
+        }
+    }
+    destination[length] = '\0';
+}
+
+/**
+ * Records a span that ends now
+ * @param name Name shown on the span
+ * @param category Category of the span (e.g. "shell", "launch")
+ * @param start When the span started, from trace_clock()
+ * @param tid Row of the trace: the shell's process ID, or a child's
+ * @param command Command the span belongs to, or NULL
+ */
+void trace_span(const char *name, const char *category, struct timespec start, long tid, const char *command)
+{
+    if (TRACE.fd == -1)
+    {
+        return;
+    }
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double start_us = (double)(start.tv_sec - TRACE.origin.tv_sec) * 1e6 +
+                      (double)(start.tv_nsec - TRACE.origin.tv_nsec) / 1e3;
+    double duration_us = (double)(end.tv_sec - start.tv_sec) * 1e6 + (double)(end.tv_nsec - start.tv_nsec) / 1e3;
+
+    char escaped_name[TRACE_TEXT_LENGTH * 6 + 1];
+    char escaped_command[TRACE_TEXT_LENGTH * 6 + 1];
+    char event[sizeof(escaped_name) + sizeof(escaped_command) + 256];
+    trace_escape(escaped_name, name);
+    trace_escape(escaped_command, command != NULL ? command : "");
+
+    int length = snprintf(event, sizeof(event),
+                          "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                          "\"pid\":%ld,\"tid\":%ld%s%s%s}",
+                          TRACE.has_events ? ",\n" : "", escaped_name, category, start_us, duration_us, TRACE.pid,
+                          tid, command != NULL ? ",\"args\":{\"command\":\"" : "", escaped_command,
+                          command != NULL ? "\"}" : "");
+    TRACE.has_events = true;
+    trace_append(event, (size_t)length);
+}
+
+/**
+ * Finishes the trace file when the shell exits (registered with atexit())
+ *
+ * Children started with fork() leave through _exit(), so they never write
+ * the shell's buffered events.
+ */
+void trace_close()
+{
+    if (TRACE.fd == -1)
+    {
+        return;
+    }
+    static const char footer[] = "\n],\"displayTimeUnit\":\"ms\"}\n";
+    trace_append(footer, sizeof(footer) - 1);
+    trace_flush();
+    if (TRACE.fd != -1)
+    {
+        close(TRACE.fd);
+        TRACE.fd = -1;
+    }
+    free(TRACE.buffer);
+    TRACE.buffer = NULL;
+}
+
+/**
+ * Starts writing a trace of the shell's work (--trace)
+ * @param file_path Trace file, created or truncated
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the file can't be created
+ */
+int trace_open(const char *file_path)
+{
+    TRACE.buffer = malloc(TRACE_BUFFER_SIZE);
+    TRACE.fd = TRACE.buffer != NULL ? open(file_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+    if (TRACE.fd == -1)
+    {
+        free(TRACE.buffer);
+        TRACE.buffer = NULL;
+        return EXIT_FAILURE;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &TRACE.origin);
+    TRACE.pid = (long)getpid();
+
+    char header[128];
+    int length = snprintf(header, sizeof(header),
+                          "{\"traceEvents\":[\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%ld,\"tid\":%ld,"
+                          "\"args\":{\"name\":\"wish\"}}",
+                          TRACE.pid, TRACE.pid);
+    trace_append(header, (size_t)length);
+    TRACE.has_events = true;
+    atexit(trace_close);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Checks whether a command is a cat or tee invocation handled by the shell
+ * @param args Array of command arguments
+ * @return true for 'cat [file...]' and 'tee [-a] [file...]'; other options
+ * are left to the external programs, and with an empty PATH no command runs
+ */
+bool is_stream_builtin(char **args)
+{
+    bool is_cat = !strcmp(args[0], "cat");
+    if ((!is_cat && strcmp(args[0], "tee")) || PATH[0] == NULL)
+    {
+        return false;
+    }
+
+    for (int i = 1; args[i] != NULL && !is_redirection_operator(args[i]); i++)
+    {
+        bool append_option = !is_cat && i == 1 && !strcmp(args[i], "-a");
+        if (args[i][0] == '-' && args[i][1] != '\0' && !append_option)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Resolves a stream built-in's redirections without touching the shell's
+ * own descriptors
+ * @param redirections Redirections parsed by parse_redirections
+ * @param streams Standard input, output and error of the built-in; updated
+ * in place
+ * @param opened Receives the descriptors opened here, for the caller to close
+ * @param opened_count Set to the number of descriptors in opened
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if a file couldn't be opened
+ * or a copied descriptor isn't open
+ *
+ * Files for descriptors above standard error are still created or truncated,
+ * but the built-ins never write to them.
+ */
+int resolve_stream_redirections(const struct redirection_list *redirections, int streams[3],
+                                int *opened, size_t *opened_count)
+{
+    *opened_count = 0;
+    for (size_t i = 0; i < redirections->count; i++)
+    {
+        const struct redirection *redirection = &redirections->items[i];
+        int file_descriptor;
+
+        if (redirection->kind == REDIRECT_OPEN)
+        {
+            file_descriptor = open(redirection->path, redirection->flags | O_CLOEXEC, 0644);
+            if (file_descriptor == -1)
+            {
+                return EXIT_FAILURE;
+            }
+            opened[(*opened_count)++] = file_descriptor;
+        }
+        else
+        {
+            file_descriptor = redirection->source_fd <= STDERR_FILENO ? streams[redirection->source_fd]
+                                                                      : redirection->source_fd;
+            if (fcntl(file_descriptor, F_GETFD) == -1)
+            {
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (redirection->fd <= STDERR_FILENO)
+        {
+            streams[redirection->fd] = file_descriptor;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Runs the cat or tee built-in
+ * @param args Array of command arguments (see is_stream_builtin)
+ * @param input_fd Descriptor the command reads as standard input, unless
+ * redirected with '<'
+ * @param output_fd Descriptor the command writes as standard output, unless
+ * redirected with '>'
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE (after reporting the error)
+ * otherwise
+ */
+int run_stream_builtin(char **args, int input_fd, int output_fd)
+{
+    struct redirection_list redirections;
+    int status = EXIT_SUCCESS;
+
+    if (parse_redirections(args, &redirections))
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_FAILURE;
+    }
+
+    int argument_count = 0;
+    while (args[argument_count] != NULL && argument_count != redirections.position)
+    {
+        argument_count++;
+    }
+
+    // Errors go through the descriptor so '2>' applies to them as well
+    fflush(ERROUTPUT);
+    int streams[3] = {input_fd, output_fd, fileno(ERROUTPUT)};
+    size_t opened_count = 0;
+    int *opened = arena_alloc(&LINE_ARENA, (redirections.count + 1) * sizeof(int));
+    if (opened == NULL || resolve_stream_redirections(&redirections, streams, opened, &opened_count))
+    {
+        for (size_t i = 0; i < opened_count; i++)
+        {
+            close(opened[i]);
+        }
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_FAILURE;
+    }
+    input_fd = streams[STDIN_FILENO];
+    output_fd = streams[STDOUT_FILENO];
+    int error_fd = streams[STDERR_FILENO];
+
+    if (!strcmp(args[0], "cat"))
+    {
+        // No file operands means copying standard input, like "cat -"
+        for (int i = 1; i < argument_count || (i == 1 && argument_count == 1); i++)
+        {
+            bool from_input = i >= argument_count || !strcmp(args[i], "-");
+            int file_descriptor = from_input ? input_fd : open(args[i], O_RDONLY | O_CLOEXEC);
+            if (file_descriptor == -1 || stream_copy(file_descriptor, output_fd))
+            {
+                dprintf(error_fd, ERROR_MSG);
+                status = EXIT_FAILURE;
+            }
+            if (!from_input && file_descriptor != -1)
+            {
+                close(file_descriptor);
+            }
+        }
+    }
+    else
+    {
+        int first_file = 1;
+        int open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        if (argument_count > 1 && !strcmp(args[1], "-a"))
+        {
+            first_file = 2;
+            open_flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+        }
+
+        // Standard output first, then every file that could be opened
+        int *outputs = arena_alloc(&LINE_ARENA, (argument_count + 1) * sizeof(int));
+        size_t output_count = 0;
+        if (outputs == NULL)
+        {
+            status = EXIT_FAILURE;
+        }
+        else
+        {
+            outputs[output_count++] = output_fd;
+            for (int i = first_file; i < argument_count; i++)
+            {
+                int file_descriptor = open(args[i], open_flags, 0644);
+                if (file_descriptor == -1)
+                {
+                    status = EXIT_FAILURE;
+                    continue;
+                }
+                outputs[output_count++] = file_descriptor;
+            }
+            if (stream_tee(input_fd, outputs, output_count))
+            {
+                status = EXIT_FAILURE;
+            }
+            for (size_t i = 1; i < output_count; i++)
+            {
+                close(outputs[i]);
+            }
+        }
+        if (status)
+        {
+            dprintf(error_fd, ERROR_MSG);
+        }
+    }
+
+    for (size_t i = 0; i < opened_count; i++)
+    {
+        close(opened[i]);
+    }
+    return status;
+}
+
+/**
+ * Executes the built-in 'cat' or 'tee' command inside the shell
+ * @param args Array of command arguments where args[0] is "cat" or "tee"
+ * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ * (including forms with options the built-ins don't support)
+ */
+int execute_stream_builtin(char **args)
+{
+    if (is_stream_builtin(args))
+    {
+        ignore_sigpipe();
+        run_stream_builtin(args, STDIN_FILENO, STDOUT_FILENO);
+        return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
+
+/**
+ * Reads the items of 'parallel CMD < file', one per line
+ * @param file_path File listing the items
+ * @param items Set to the items, allocated from LINE_ARENA
+ * @param item_count Set to the number of items
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the file couldn't be read
+ *
+ * The file is read in one go and split in place; empty lines are skipped.
+ */
+int read_parallel_items(const char *file_path, char ***items, size_t *item_count)
+{
+    int file_descriptor = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (file_descriptor == -1)
+    {
+        return EXIT_FAILURE;
+    }
+
+    size_t capacity = STREAM_CHUNK;
+    size_t length = 0;
+    char *data = arena_alloc(&LINE_ARENA, capacity);
+    while (data != NULL)
+    {
+        // Keep room for a whole chunk and the terminating NUL
+        if (capacity - length <= STREAM_CHUNK)
+        {
+            data = arena_grow(&LINE_ARENA, data, capacity, capacity * 2);
+            capacity *= 2;
+            continue;
+        }
+
+        ssize_t count = read(file_descriptor, data + length, STREAM_CHUNK);
+        if (count == 0)
+        {
+            break;
+        }
+        if (count == -1 && errno != EINTR)
+        {
+            data = NULL;
+        }
+        else if (count > 0)
+        {
+            length += count;
+        }
+    }
+    close(file_descriptor);
+    if (data == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    data[length] = '\0';
+
+    size_t line_count = 1;
+    for (size_t i = 0; i < length; i++)
+    {
+        line_count += data[i] == '\n';
+    }
+    *items = arena_alloc(&LINE_ARENA, line_count * sizeof(char *));
+    if (*items == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    *item_count = 0;
+    for (char *line = data; *line != '\0';)
+    {
+        char *line_end = strchrnul(line, '\n');
+        char *next = *line_end == '\n' ? line_end + 1 : line_end;
+
+        // Accept files with DOS line endings
+        if (line_end > line && line_end[-1] == '\r')
+        {
+            line_end--;
+        }
+        *line_end = '\0';
+        if (line_end > line)
+        {
+            (*items)[(*item_count)++] = line;
+        }
+        line = next;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Analyses the command of a 'parallel' built-in once for all of its items
+ * @param args Template arguments
+ * @param length Number of template arguments
+ * @param template Set to the analysed template
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ */
+int parse_parallel_template(char **args, size_t length, struct parallel_template *template)
+{
+    template->args = args;
+    template->length = length;
+    template->item_position = SIZE_MAX;
+    template->placeholders = arena_alloc(&LINE_ARENA, length * sizeof(size_t));
+    if (template->placeholders == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    bool has_placeholder = false;
+    for (size_t i = 0; i < length; i++)
+    {
+        template->placeholders[i] = 0;
+        for (const char *found = args[i]; (found = strstr(found, PARALLEL_PLACEHOLDER)) != NULL;
+             found += strlen(PARALLEL_PLACEHOLDER))
+        {
+            template->placeholders[i]++;
+            has_placeholder = true;
+        }
+    }
+
+    // Without a placeholder the item becomes the last argument, before any
+    // redirection
+    if (!has_placeholder)
+    {
+        template->item_position = 0;
+        while (template->item_position < length && !is_redirection_operator(args[template->item_position]))
+        {
+            template->item_position++;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Builds the arguments of one job from a 'parallel' template
+ * @param template Template analysed by parse_parallel_template
+ * @param item Item substituted for every placeholder
+ * @return NULL-terminated arguments allocated from LINE_ARENA, or NULL if
+ * memory couldn't be allocated
+ *
+ * Arguments without a placeholder are shared with the template; the item
+ * is always a single argument, whatever it contains.
+ */
+char **expand_parallel_template(const struct parallel_template *template, const char *item)
+{
+    size_t placeholder_length = strlen(PARALLEL_PLACEHOLDER);
+    size_t item_length = strlen(item);
+    size_t extra = template->item_position != SIZE_MAX ? 1 : 0;
+    char **args = arena_alloc(&LINE_ARENA, (template->length + extra + 1) * sizeof(char *));
+    if (args == NULL)
+    {
+        return NULL;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < template->length; i++)
+    {
+        if (i == template->item_position)
+        {
+            args[count++] = (char *)item;
+        }
+        if (template->placeholders[i] == 0)
+        {
+            args[count++] = template->args[i];
+            continue;
+        }
+
+        const char *source = template->args[i];
+        char *expanded = arena_alloc(&LINE_ARENA, strlen(source) + 1 +
+                                     template->placeholders[i] * item_length);
+        if (expanded == NULL)
+        {
+            return NULL;
+        }
+        char *destination = expanded;
+        for (const char *found; (found = strstr(source, PARALLEL_PLACEHOLDER)) != NULL;
+             source = found + placeholder_length)
+        {
+            memcpy(destination, source, found - source);
+            destination += found - source;
+            memcpy(destination, item, item_length);
+            destination += item_length;
+        }
+        strcpy(destination, source);
+        args[count++] = expanded;
+    }
+    if (template->item_position == template->length)
+    {
+        args[count++] = (char *)item;
+    }
+    args[count] = NULL;
+    return args;
+}
+
+/**
+ * Executes the built-in 'parallel' command, which runs a command once per item
+ * @param args Array of command arguments: "parallel CMD ... ::: ITEM ..." or
+ * "parallel CMD ... < FILE" (one item per line)
+ * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ *
+ * The command is analysed once; each item only costs a copy of the argument
+ * vector, with PARALLEL_PLACEHOLDER replaced by the item (or the item
+ * appended when CMD has no placeholder). The jobs are queued right after the
+ * 'parallel' command itself, so the scheduler runs them under JOBS_LIMIT.
+ */
+int execute_parallel(char **args)
+{
+    if (strcmp(args[0], "parallel"))
+    {
+        return EXIT_FAILURE;
+    }
+
+    size_t length = 0;
+    while (args[1 + length] != NULL && strcmp(args[1 + length], PARALLEL_ITEMS_DELIM))
+    {
+        length++;
+    }
+
+    char **items = NULL;
+    size_t item_count = 0;
+    if (args[1 + length] != NULL)
+    {
+        // Items given on the command line
+        items = &args[2 + length];
+        while (items[item_count] != NULL)
+        {
+            item_count++;
+        }
+    }
+    else if (length >= 3 && !strcmp(args[length - 1], INPUT_REDIRECTION_DELIM))
+    {
+        // Items listed in a file
+        if (read_parallel_items(args[length], &items, &item_count))
+        {
+            fprintf(ERROUTPUT, ERROR_MSG);
+            return EXIT_SUCCESS;
+        }
+        length -= 2;
+    }
+    else
+    {
+        // Error case: no items (e.g., "parallel echo")
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_SUCCESS;
+    }
+
+    // Error case: no command (e.g., "parallel ::: a b")
+    struct parallel_template template;
+    if (length == 0 || parse_parallel_template(&args[1], length, &template))
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_SUCCESS;
+    }
+
+    char ***job_args = arena_alloc(&LINE_ARENA, (item_count + 1) * sizeof(char **));
+    if (job_args == NULL)
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_SUCCESS;
+    }
+    for (size_t i = 0; i < item_count; i++)
+    {
+        job_args[i] = expand_parallel_template(&template, items[i]);
+        if (job_args[i] == NULL)
+        {
+            fprintf(ERROUTPUT, ERROR_MSG);
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (job_table_insert(JOBS.next_pending, job_args, item_count))
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_SUCCESS;
+    }
+
+    // With --parallel-batch the jobs belong to the line of the 'parallel'
+    // command, which only finishes with them
+    size_t batch_line = JOBS.jobs[JOBS.next_pending - 1].batch_line;
+    if (batch_line != SIZE_MAX)
+    {
+        BATCH.lines[batch_line].unfinished_jobs += item_count;
+        for (size_t i = 0; i < item_count; i++)
+        {
+            JOBS.jobs[JOBS.next_pending + i].batch_line = batch_line;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Checks and executes built-in shell commands
+ * @param args Array of command arguments
+ * @return EXIT_SUCCESS if a built-in command was executed, EXIT_FAILURE
+ * otherwise
+ */
+int execute_builtin_command(char **args)
+{
+    // Try to execute as exit command
+    if (!execute_exit(args))
+        return EXIT_SUCCESS;
+
+    // Try to execute as cd command
+    if (!execute_cd(args))
+        return EXIT_SUCCESS;
+
+    // Try to execute as path command
+    if (!execute_path(args))
+        return EXIT_SUCCESS;
+
+    // Try to execute as hash command
+    if (!execute_hash(args))
+        return EXIT_SUCCESS;
+
+    // Try to execute as jobs-limit command
+    if (!execute_jobs_limit(args))
+        return EXIT_SUCCESS;
+
+    // Try to execute as load-limit command
+    if (!execute_load_limit(args))
+        return EXIT_SUCCESS;
+
+    // Try to execute as times command
+    if (!execute_times(args))
+        return EXIT_SUCCESS;
+
+    // Try to execute as stats command
+    if (!execute_stats(args))
+        return EXIT_SUCCESS;
+
+    // Try to execute as cat or tee command
+    if (!execute_stream_builtin(args))
+        return EXIT_SUCCESS;
+
+    // Try to execute as parallel command
+    if (!execute_parallel(args))
+        return EXIT_SUCCESS;
+
+    // Not a built-in command
+    return EXIT_FAILURE;
+}
+
+/**
+ * Moves a new child into the process group of the job being started
+ * @param pid Process ID of the child
+ *
+ * The child joins the group itself as well; whichever runs first wins, so
+ * the group exists before the shell may have to signal it.
+ */
+void join_launch_group(pid_t pid)
+{
+    if (LAUNCH_PROCESS_GROUP == -1)
+    {
+        return;
+    }
+    setpgid(pid, LAUNCH_PROCESS_GROUP);
+    if (LAUNCH_PROCESS_GROUP == 0)
+    {
+        LAUNCH_PROCESS_GROUP = pid;
+    }
+}
+
+/**
+ * Starts an external command with fork
+ * @param args Array of arguments for the command
+ * @param executable_path Resolved path of the executable
+ * @param redirections Redirections parsed by prepare_command
+ * @param input_fd Descriptor to use as standard input, or -1 to inherit it
+ * @param output_fd Descriptor to use as standard output, or -1 to inherit it
+ * @param error_fd Descriptor to use as standard error, or -1 to inherit it
+ * @param process_id Pointer to store the process ID of the child
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int fork_command(char **args, const char *executable_path, const struct redirection_list *redirections,
+                 int input_fd, int output_fd, int error_fd, pid_t *process_id)
+{
+    // Create a child process to execute the external command
+    pid_t child_pid = fork();
+
+    // Handle possible fork outcomes
+    if (child_pid == -1)
+    {
+        // Fork failed - system couldn't create a new process
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_FAILURE;
+    }
+    else if (child_pid == 0)
+    {
+        // Child process code path
+        // Undo the SIGCHLD blocking used by the shell's event loop
+        sigprocmask(SIG_SETMASK, &EVENTS.child_mask, NULL);
+        if (LAUNCH_PROCESS_GROUP != -1)
+        {
+            setpgid(0, LAUNCH_PROCESS_GROUP);
+        }
+
+        // Connect the pipeline ends first so redirections override them
+        bool pipes_connected = (input_fd == -1 || dup2(input_fd, STDIN_FILENO) != -1) &&
+                               (output_fd == -1 || dup2(output_fd, STDOUT_FILENO) != -1) &&
+                               (error_fd == -1 || dup2(error_fd, STDERR_FILENO) != -1);
+
+        // Handle any redirection in the child process 
+        // (important to do this in the child so it doesn't affect the parent)
+        if (pipes_connected && !apply_redirections(args, redirections))
+        {
+            // The executable was resolved by the shell, so exec exactly once
+            execv(executable_path, args);
+        }
+
+        // If we reach here, a redirection or the exec itself failed
+        fprintf(ERROUTPUT, ERROR_MSG);
+        fflush(ERROUTPUT);
+        _exit(EXIT_FAILURE); // Exit child without flushing the shell's buffers
+    }
+
+    // Parent process code path
+    // Save child process PID for later waitpid call in parallel execution
+    *process_id = child_pid;
+    join_launch_group(child_pid);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Starts an external command with posix_spawn
+ * @param args Array of arguments for the command
+ * @param executable_path Resolved path of the executable
+ * @param redirections Redirections parsed by prepare_command
+ * @param input_fd Descriptor to use as standard input, or -1 to inherit it
+ * @param output_fd Descriptor to use as standard output, or -1 to inherit it
+ * @param error_fd Descriptor to use as standard error, or -1 to inherit it
+ * @param process_id Pointer to store the process ID of the child
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ *
+ * The child only has to apply a few file actions and exec once. glibc
+ * implements posix_spawn with clone(CLONE_VM | CLONE_VFORK), which avoids
+ * copying the shell's page tables for every command.
+ */
+int spawn_command(char **args, const char *executable_path, const struct redirection_list *redirections,
+                  int input_fd, int output_fd, int error_fd, pid_t *process_id)
+{
+    posix_spawn_file_actions_t file_actions;
+    posix_spawn_file_actions_init(&file_actions);
+
+    // Pipeline ends are marked close-on-exec; dup2 gives the child copies
+    // that survive the exec
+    int action_error = 0;
+    if (input_fd != -1)
+    {
+        action_error = posix_spawn_file_actions_adddup2(&file_actions, input_fd, STDIN_FILENO);
+    }
+    if (output_fd != -1 && !action_error)
+    {
+        action_error = posix_spawn_file_actions_adddup2(&file_actions, output_fd, STDOUT_FILENO);
+    }
+    if (error_fd != -1 && !action_error)
+    {
+        action_error = posix_spawn_file_actions_adddup2(&file_actions, error_fd, STDERR_FILENO);
+    }
+
+    // Redirections become file actions, applied in line order after the
+    // pipeline ends so they override them
+    for (size_t i = 0; i < redirections->count && !action_error; i++)
+    {
+        const struct redirection *redirection = &redirections->items[i];
+        if (redirection->kind == REDIRECT_OPEN)
+        {
+            action_error = posix_spawn_file_actions_addopen(&file_actions, redirection->fd, redirection->path,
+                                                            redirection->flags, 0644);
+        }
+        else
+        {
+            action_error = posix_spawn_file_actions_adddup2(&file_actions, redirection->source_fd, redirection->fd);
+        }
+    }
+
+    // A redirection the child can't get must not be dropped silently
+    if (action_error)
+    {
+        posix_spawn_file_actions_destroy(&file_actions);
+        *process_id = 0;
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_FAILURE;
+    }
+
+    // Hide the redirection tokens from the command's argument vector
+    char *redirection_token = NULL;
+    if (redirections->position != -1)
+    {
+        redirection_token = args[redirections->position];
+        args[redirections->position] = NULL;
+    }
+
+    // Children start with the signal mask the shell was started with
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &EVENTS.child_mask);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    if (LAUNCH_PROCESS_GROUP != -1)
+    {
+        posix_spawnattr_setpgroup(&attributes, LAUNCH_PROCESS_GROUP);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attributes, flags);
+
+    int spawn_error = posix_spawn(process_id, executable_path, &file_actions, &attributes, args, environ);
+    posix_spawnattr_destroy(&attributes);
+
+    // Restore the arguments so the caller can release them as usual
+    if (redirections->position != -1)
+    {
+        args[redirections->position] = redirection_token;
+    }
+    posix_spawn_file_actions_destroy(&file_actions);
+
+    if (spawn_error)
+    {
+        // Spawn failed - a redirection couldn't be applied or exec failed
+        *process_id = 0;
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_FAILURE;
+    }
+    join_launch_group(*process_id);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Starts a cat or tee pipeline stage (or captured command) in a child process
+ * @param args Array of arguments for the built-in
+ * @param input_fd Descriptor to use as standard input, or -1 to inherit it
+ * @param output_fd Descriptor to use as standard output, or -1 to inherit it
+ * @param error_fd Descriptor to use as standard error, or -1 to inherit it
+ * @param process_id Pointer to store the process ID of the child
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ *
+ * The stage has to run concurrently with the rest of the pipeline, so it is
+ * forked; it never execs, and moves its data with splice()/tee().
+ */
+int fork_stream_builtin(char **args, int input_fd, int output_fd, int error_fd, pid_t *process_id)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t child_pid = fork();
+
+    if (child_pid == -1)
+    {
+        STATS.exec_failures++;
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_FAILURE;
+    }
+    else if (child_pid == 0)
+    {
+        sigprocmask(SIG_SETMASK, &EVENTS.child_mask, NULL);
+        if (LAUNCH_PROCESS_GROUP != -1)
+        {
+            setpgid(0, LAUNCH_PROCESS_GROUP);
+        }
+
+        if ((input_fd != -1 && dup2(input_fd, STDIN_FILENO) == -1) ||
+            (output_fd != -1 && dup2(output_fd, STDOUT_FILENO) == -1) ||
+            (error_fd != -1 && dup2(error_fd, STDERR_FILENO) == -1))
+        {
+            fprintf(ERROUTPUT, ERROR_MSG);
+            _exit(EXIT_FAILURE);
+        }
+
+        // Without an exec, close-on-exec never fires: drop the shell's other
+        // descriptors so pipe ends held here can't keep a reader waiting
+        closefrom(STDERR_FILENO + 1);
+
+        int status = run_stream_builtin(args, STDIN_FILENO, STDOUT_FILENO);
+        fflush(ERROUTPUT);
+        _exit(status);
+    }
+
+    *process_id = child_pid;
+    join_launch_group(child_pid);
+    trace_span("fork", "launch", start, TRACE.pid, args[0]);
+    histogram_record_since(&STATS.spawn, &start);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Validates the redirections of an external command and resolves it in PATH
+ * @param args Array of arguments for the command
+ * @param redirections Set to the command's redirections
+ * @param executable_path Set to the resolved path of the executable
+ * @return EXIT_SUCCESS if the command can be started, EXIT_FAILURE (after
+ * reporting the error) otherwise
+ */
+int prepare_command(char **args, struct redirection_list *redirections, const char **executable_path)
+{
+    // Redirection errors are reported before any process is created
+    if (parse_redirections(args, redirections))
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_FAILURE;
+    }
+
+    // Resolve the command in the shell so the child execs exactly once
+    struct timespec start = trace_clock();
+    *executable_path = lookup_executable(args[0]);
+    trace_span("resolve", "path", start, TRACE.pid, args[0]);
+    if (*executable_path == NULL)
+    {
+        STATS.lookup_failures++;
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Starts a prepared external command with the selected launcher
+ * @param args Array of arguments for the command
+ * @param executable_path Resolved path of the executable
+ * @param redirections Redirections parsed by prepare_command
+ * @param input_fd Descriptor to use as standard input, or -1 to inherit it
+ * @param output_fd Descriptor to use as standard output, or -1 to inherit it
+ * @param error_fd Descriptor to use as standard error, or -1 to inherit it
+ * @param process_id Pointer to store the process ID of the child
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int launch_command(char **args, const char *executable_path, const struct redirection_list *redirections,
+                   int input_fd, int output_fd, int error_fd, pid_t *process_id)
+{
+    // posix_spawn() returns once the child has exec'd, so its span covers
+    // the exec as well
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int status;
+    if (LAUNCHER == LAUNCHER_FORK)
+    {
+        status = fork_command(args, executable_path, redirections, input_fd, output_fd, error_fd, process_id);
+        trace_span("fork", "launch", start, TRACE.pid, args[0]);
+    }
+    else
+    {
+        status = spawn_command(args, executable_path, redirections, input_fd, output_fd, error_fd, process_id);
+        trace_span("spawn", "launch", start, TRACE.pid, args[0]);
+    }
+
+    histogram_record_since(&STATS.spawn, &start);
+    STATS.exec_failures += status == EXIT_SUCCESS ? 0 : 1;
+    return status;
+}
+
+/**
+ * Executes a command as a built-in or with the selected launcher
+ * @param args Array of arguments for the command
+ * @param output_fd Descriptor to use as the child's standard output, or -1 to
+ * inherit it (built-ins other than cat and tee write to the shell's own)
+ * @param error_fd Descriptor to use as standard error, or -1 to inherit it
+ * @param process_id Pointer to store the process ID (for parallel execution);
+ * set to 0 when no child process was created
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ */
+int execute_command(char **args, int output_fd, int error_fd, pid_t *process_id)
+{
+    *process_id = 0;
+
+    // cat and tee only run in the shell when nothing else has to go on
+    // meanwhile. Under --group-output or --tag they must write into the
+    // job's capture pipes, next to other jobs they must not hold up the
+    // scheduler, and with a time limit they must be in the job's process
+    // group: then they run in a child like a pipeline stage
+    bool concurrent = JOBS.count > 1 || PARALLEL_BATCH || LAUNCH_PROCESS_GROUP != -1;
+    if ((output_fd != -1 || error_fd != -1 || concurrent) && is_stream_builtin(args))
+    {
+        return fork_stream_builtin(args, -1, output_fd, error_fd, process_id);
+    }
+
+    // First try to handle as a built-in command (cd, exit, path)
+    struct timespec start = trace_clock();
+    if (!execute_builtin_command(args))
+    {
+        // If it's a built-in command, execute it and return success
+        // No need to track process ID for built-in commands
+        trace_span("builtin", "shell", start, TRACE.pid, args[0]);
+        STATS.builtins++;
+        return EXIT_SUCCESS;
+    }
+
+    struct redirection_list redirections;
+    const char *executable_path;
+    if (prepare_command(args, &redirections, &executable_path))
+    {
+        return EXIT_FAILURE;
+    }
+    return launch_command(args, executable_path, &redirections, -1, output_fd, error_fd, process_id);
+}
+
+/**
+ * Opens a process file descriptor for a child
+ * @param pid Process ID of the child
+ * @return The pidfd, or -1 if the kernel doesn't support pidfd_open
+ */
+int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+/**
+ * Sets up the event loop used to reap children
+ *
+ * Each child is watched with a pidfd registered in epoll. On kernels without
+ * pidfd_open, SIGCHLD is blocked and delivered through a signalfd instead. If
+ * neither works the shell falls back to a blocking waitpid().
+ */
+void event_loop_init()
+{
+    sigprocmask(SIG_SETMASK, NULL, &EVENTS.child_mask);
+
+    EVENTS.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (EVENTS.epoll_fd == -1)
+    {
+        return;
+    }
+
+    // Probe pidfd support with the shell's own process
+    int probe = open_pidfd(getpid());
+    if (probe != -1)
+    {
+        close(probe);
+        EVENTS.use_pidfd = true;
+        return;
+    }
+
+    sigset_t child_signal;
+    sigemptyset(&child_signal);
+    sigaddset(&child_signal, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &child_signal, NULL);
+
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = EVENT_DATA(EVENT_SIGCHLD, 0)};
+    EVENTS.signal_fd = signalfd(-1, &child_signal, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (EVENTS.signal_fd == -1 || epoll_ctl(EVENTS.epoll_fd, EPOLL_CTL_ADD, EVENTS.signal_fd, &event))
+    {
+        // No way to be notified; go back to plain waitpid()
+        sigprocmask(SIG_SETMASK, &EVENTS.child_mask, NULL);
+        close(EVENTS.epoll_fd);
+        EVENTS.epoll_fd = -1;
+        if (EVENTS.signal_fd != -1)
+        {
+            close(EVENTS.signal_fd);
+            EVENTS.signal_fd = -1;
+        }
+    }
+}
+
+/**
+ * Opens a private non-blocking descriptor for the read end of a jobserver
+ * @param file_descriptor Inherited read end of the jobserver pipe
+ * @return The new descriptor, or -1 on failure
+ *
+ * Setting O_NONBLOCK on the inherited descriptor would change it for make
+ * as well, so the pipe is opened again through /proc to get a separate
+ * open file description.
+ */
+int jobserver_reopen(int file_descriptor)
+{
+    char proc_path[64];
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", file_descriptor);
+    return open(proc_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+/**
+ * Joins the jobserver of an outer make, if MAKEFLAGS describes one
+ * @param makeflags Value of MAKEFLAGS
+ * @return EXIT_SUCCESS if the jobserver can be used, EXIT_FAILURE otherwise
+ *
+ * Understands "--jobserver-auth=fifo:PATH" (make 4.4) and
+ * "--jobserver-auth=R,W" / "--jobserver-fds=R,W" (older makes); the last
+ * one given wins, as in make.
+ */
+int jobserver_join(const char *makeflags)
+{
+    const char *value = NULL;
+    static const char *options[] = {"--jobserver-auth=", "--jobserver-fds="};
+
+    for (size_t i = 0; i < sizeof(options) / sizeof(options[0]); i++)
+    {
+        for (const char *found = makeflags; (found = strstr(found, options[i])) != NULL; found++)
+        {
+            if (value == NULL || found + strlen(options[i]) > value)
+            {
+                value = found + strlen(options[i]);
+            }
+        }
+    }
+    if (value == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    if (!strncmp(value, "fifo:", 5))
+    {
+        // One read-write descriptor serves both directions
+        size_t path_length = strcspn(value + 5, " ");
+        char *fifo_path = strndup(value + 5, path_length);
+        if (fifo_path == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        JOBSERVER.read_fd = open(fifo_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+        free(fifo_path);
+        JOBSERVER.write_fd = JOBSERVER.read_fd;
+        return JOBSERVER.read_fd == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    int read_end, write_end;
+    if (sscanf(value, "%d,%d", &read_end, &write_end) != 2 || read_end < 0 || write_end < 0 ||
+        fcntl(read_end, F_GETFD) == -1 || fcntl(write_end, F_GETFD) == -1)
+    {
+        // make didn't pass the descriptors on (the command isn't marked as
+        // recursive); run without the jobserver
+        return EXIT_FAILURE;
+    }
+    JOBSERVER.read_fd = jobserver_reopen(read_end);
+    JOBSERVER.write_fd = write_end;
+    return JOBSERVER.read_fd == -1 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Creates a jobserver for the children, shared with the shell's own jobs
+ * @param job_limit Total number of jobs that may run at once
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE otherwise
+ *
+ * The pipe holds job_limit - 1 tokens and is left open across exec, and
+ * MAKEFLAGS tells sub-makes where to find it. The options are appended to
+ * any MAKEFLAGS the user already set, so flags like -s or -k survive.
+ */
+int jobserver_create(size_t job_limit)
+{
+    int pipe_fds[2];
+    if (pipe(pipe_fds))
+    {
+        return EXIT_FAILURE;
+    }
+
+    char tokens[STREAM_CHUNK];
+    size_t token_count = job_limit - 1 < sizeof(tokens) ? job_limit - 1 : sizeof(tokens);
+    memset(tokens, JOBSERVER_TOKEN, token_count);
+
+    const char *user_flags = getenv("MAKEFLAGS");
+    user_flags = user_flags != NULL ? user_flags : "";
+    size_t size = strlen(user_flags) + 64;
+    char *makeflags = malloc(size);
+    if (makeflags == NULL)
+    {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return EXIT_FAILURE;
+    }
+    snprintf(makeflags, size, "%s -j%zu --jobserver-auth=%d,%d", user_flags, job_limit, pipe_fds[0], pipe_fds[1]);
+
+    JOBSERVER.read_fd = jobserver_reopen(pipe_fds[0]);
+    JOBSERVER.write_fd = pipe_fds[1];
+    int status = JOBSERVER.read_fd == -1 || write_all(pipe_fds[1], tokens, token_count) ||
+                 setenv("MAKEFLAGS", makeflags, 1) ? EXIT_FAILURE : EXIT_SUCCESS;
+    free(makeflags);
+
+    if (status == EXIT_FAILURE)
+    {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        if (JOBSERVER.read_fd != -1)
+        {
+            close(JOBSERVER.read_fd);
+        }
+    }
+    return status;
+}
+
+/**
+ * Returns a token to the jobserver, or frees the implicit token
+ * @param token Token byte held by a finished job, or -1 for the implicit one
+ */
+void jobserver_release(int token)
+{
+    if (!JOBSERVER.active)
+    {
+        return;
+    }
+    if (token == -1)
+    {
+        JOBSERVER.implicit_in_use = false;
+        return;
+    }
+
+    char byte = (char)token;
+    while (write(JOBSERVER.write_fd, &byte, 1) == -1 && errno == EINTR)
+    {
+    }
+}
+
+/**
+ * Returns the tokens of jobs still running when the shell exits, so the
+ * outer make doesn't lose them
+ */
+void jobserver_release_all()
+{
+    for (size_t i = 0; i < JOBS.count; i++)
+    {
+        if (JOBS.jobs[i].state == JOB_RUNNING && JOBS.jobs[i].jobserver_token != -1)
+        {
+            jobserver_release(JOBS.jobs[i].jobserver_token);
+            JOBS.jobs[i].jobserver_token = -1;
+        }
+    }
+}
+
+/**
+ * Sets up the jobserver: joins the one of an outer make if there is one,
+ * otherwise creates one when -j was given
+ */
+void jobserver_init()
+{
+    const char *makeflags = getenv("MAKEFLAGS");
+
+    if (makeflags != NULL && !jobserver_join(makeflags))
+    {
+        JOBSERVER.active = true;
+    }
+    else if (JOBS_LIMIT_GIVEN && JOBS_LIMIT > 0 && !jobserver_create(JOBS_LIMIT))
+    {
+        JOBSERVER.active = true;
+    }
+
+    if (JOBSERVER.active)
+    {
+        atexit(jobserver_release_all);
+    }
+}
+
+/**
+ * Takes what a job needs from the jobserver before it is started
+ * @param token Set to the token taken, or -1 if the job runs on the implicit
+ * token (or there is no jobserver)
+ * @return true if the job may start, false if it has to wait for a token
+ *
+ * When no token is available the jobserver is watched by the event loop, so
+ * the scheduler retries as soon as one is returned.
+ */
+bool jobserver_acquire(int *token)
+{
+    *token = -1;
+    if (!JOBSERVER.active)
+    {
+        return true;
+    }
+    if (!JOBSERVER.implicit_in_use)
+    {
+        JOBSERVER.implicit_in_use = true;
+        return true;
+    }
+
+    unsigned char byte;
+    ssize_t count = read(JOBSERVER.read_fd, &byte, 1);
+    if (count == 1)
+    {
+        *token = byte;
+        return true;
+    }
+    if (count == -1 && (errno == EAGAIN || errno == EINTR))
+    {
+        struct epoll_event event = {.events = EPOLLIN, .data.u64 = EVENT_DATA(EVENT_JOBSERVER, 0)};
+        if (!JOBSERVER.waiting && EVENTS.epoll_fd != -1 &&
+            !epoll_ctl(EVENTS.epoll_fd, EPOLL_CTL_ADD, JOBSERVER.read_fd, &event))
+        {
+            JOBSERVER.waiting = true;
+        }
+        return false;
+    }
+
+    // The jobserver is gone; fall back to JOBS_LIMIT alone
+    JOBSERVER.active = false;
+    return true;
+}
+
+/**
+ * Records a child started for a job
+ * @param job Index of the owning job in JOBS
+ * @param pid Process ID of the child
+ * @param args Arguments of the pipeline stage the child runs
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ */
+int process_table_add(size_t job, pid_t pid, char **args)
+{
+    if (PROCESSES.count == PROCESSES.capacity)
+    {
+        size_t new_capacity = PROCESSES.capacity ? PROCESSES.capacity * 2 : JOB_TABLE_INITIAL_CAPACITY;
+        struct process *new_processes = realloc(PROCESSES.processes, new_capacity * sizeof(*new_processes));
+        if (new_processes == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        PROCESSES.processes = new_processes;
+        PROCESSES.capacity = new_capacity;
+    }
+
+    struct process *process = &PROCESSES.processes[PROCESSES.count++];
+    process->pid = pid;
+    process->pidfd = -1;
+    process->status = 0;
+    process->job = job;
+    process->running = true;
+    process->args = args;
+    process->started_at = trace_clock();
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Closes a job's capture pipes and frees whatever output they collected
+ * @param job The job whose output is discarded or has been written out
+ */
+void job_output_release(struct job *job)
+{
+    for (int stream = 0; stream < 2; stream++)
+    {
+        struct output_buffer *output = &job->output[stream];
+        if (output->read_fd != -1)
+        {
+            // Closing the pipe also removes it from the epoll set
+            close(output->read_fd);
+            output->read_fd = -1;
+        }
+        if (output->spill_fd != -1)
+        {
+            close(output->spill_fd);
+            output->spill_fd = -1;
+        }
+        free(output->data);
+        output->data = NULL;
+        output->length = 0;
+        output->capacity = 0;
+    }
+    job->open_outputs = 0;
+}
+
+/**
+ * Creates the pipes that capture a job's standard output and error
+ * @param job_index Index of the job about to be started in JOBS
+ * @param write_fds Set to the write ends to hand to the job's processes
+ * (close-on-exec, so only the descriptors dup'ed into a child survive)
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the pipes couldn't be set
+ * up, in which case write_fds are -1
+ *
+ * The read ends are watched by the event loop, which collects the output
+ * while the job runs.
+ */
+int job_output_open(size_t job_index, int write_fds[2])
+{
+    struct job *job = &JOBS.jobs[job_index];
+
+    write_fds[0] = write_fds[1] = -1;
+    if (EVENTS.epoll_fd == -1)
+    {
+        return EXIT_FAILURE; // Nothing could drain the pipes
+    }
+
+    bool ready = true;
+    for (int stream = 0; stream < 2 && ready; stream++)
+    {
+        int pipe_fds[2];
+        struct epoll_event event = {.events = EPOLLIN, .data.u64 = EVENT_DATA(EVENT_JOB_OUTPUT, job_index * 2 + stream)};
+        if (pipe2(pipe_fds, O_CLOEXEC))
+        {
+            ready = false;
+            break;
+        }
+        job->output[stream].read_fd = pipe_fds[0];
+        write_fds[stream] = pipe_fds[1];
+        job->open_outputs++;
+        ready = !epoll_ctl(EVENTS.epoll_fd, EPOLL_CTL_ADD, pipe_fds[0], &event);
+    }
+
+    if (ready)
+    {
+        return EXIT_SUCCESS;
+    }
+
+    // Out of descriptors: undo everything
+    for (int stream = 0; stream < 2; stream++)
+    {
+        if (write_fds[stream] != -1)
+        {
+            close(write_fds[stream]);
+            write_fds[stream] = -1;
+        }
+    }
+    job_output_release(job);
+    return EXIT_FAILURE;
+}
+
+/**
+ * Moves a stream's buffered output into its memfd to bound memory use
+ * @param output The stream whose buffer reached OUTPUT_SPILL_THRESHOLD
+ *
+ * If no memfd can be created or written, the output simply stays in memory.
+ */
+void job_output_spill(struct output_buffer *output)
+{
+    if (output->spill_fd == -1)
+    {
+        output->spill_fd = memfd_create("wish-output", MFD_CLOEXEC);
+        if (output->spill_fd == -1)
+        {
+            return;
+        }
+    }
+    if (!write_all(output->spill_fd, output->data, output->length))
+    {
+        output->length = 0;
+    }
+}
+
+/**
+ * Writes a finished job's captured output to the shell's standard output
+ * and error, then releases it
+ * @param job The job whose processes have all exited and whose pipes are
+ * drained
+ *
+ * Each stream is written in one go by the shell, so the output of different
+ * jobs never interleaves.
+ */
+void job_output_flush(struct job *job)
+{
+    ignore_sigpipe();
+    for (int stream = 0; stream < 2; stream++)
+    {
+        struct output_buffer *output = &job->output[stream];
+
+        // Spilled output comes first; the memfd is copied inside the kernel
+        if (output->spill_fd != -1 && lseek(output->spill_fd, 0, SEEK_SET) == 0)
+        {
+            stream_copy(output->spill_fd, output->target_fd);
+        }
+        write_all(output->target_fd, output->data, output->length);
+    }
+    job_output_release(job);
+}
+
+/**
+ * Writes the complete lines captured from a job stream, each prefixed with
+ * the job's tag and a tab
+ * @param job_index Index of the job in JOBS
+ * @param stream 0 for standard output, 1 for standard error
+ * @param at_end Whether the stream reached end of file, so a last line
+ * without a newline is written too (a newline is added)
+ *
+ * All lines are composed into TAG_BUFFER and written with one write, so a
+ * line is never torn by another job's output. Only a line longer than
+ * OUTPUT_SPILL_THRESHOLD is cut, to bound the memory held per stream.
+ */
+void job_output_emit_lines(size_t job_index, int stream, bool at_end)
+{
+    struct job *job = &JOBS.jobs[job_index];
+    struct output_buffer *output = &job->output[stream];
+
+    // Everything up to the last newline is ready to go
+    size_t end = output->length;
+    while (end > 0 && output->data[end - 1] != '\n')
+    {
+        end--;
+    }
+    if (at_end || (end == 0 && output->length >= OUTPUT_SPILL_THRESHOLD))
+    {
+        end = output->length;
+    }
+    if (end == 0)
+    {
+        return;
+    }
+
+    char number[24];
+    const char *tag = job->args[0];
+    if (TAG_SOURCE == TAG_JOB_NUMBER)
+    {
+        snprintf(number, sizeof(number), "%zu", job_index + 1);
+        tag = number;
+    }
+    size_t tag_length = strlen(tag);
+
+    // Size for one tag per line, plus a newline for an unterminated last line
+    size_t line_count = 1;
+    for (const char *newline = output->data; (newline = memchr(newline, '\n', output->data + end - newline)) != NULL; newline++)
+    {
+        line_count++;
+    }
+    size_t needed = end + line_count * (tag_length + 1) + 1;
+    if (needed > TAG_BUFFER_SIZE)
+    {
+        char *new_buffer = realloc(TAG_BUFFER, needed);
+        if (new_buffer == NULL)
+        {
+            fprintf(ERROUTPUT, ERROR_MSG);
+            return;
+        }
+        TAG_BUFFER = new_buffer;
+        TAG_BUFFER_SIZE = needed;
+    }
+
+    size_t composed = 0;
+    size_t line_start = 0;
+    while (line_start < end)
+    {
+        const char *newline = memchr(output->data + line_start, '\n', end - line_start);
+        size_t line_end = newline != NULL ? (size_t)(newline - output->data) + 1 : end;
+
+        memcpy(TAG_BUFFER + composed, tag, tag_length);
+        composed += tag_length;
+        TAG_BUFFER[composed++] = '\t';
+        memcpy(TAG_BUFFER + composed, output->data + line_start, line_end - line_start);
+        composed += line_end - line_start;
+        line_start = line_end;
+    }
+    if (TAG_BUFFER[composed - 1] != '\n')
+    {
+        TAG_BUFFER[composed++] = '\n';
+    }
+
+    ignore_sigpipe();
+    write_all(output->target_fd, TAG_BUFFER, composed);
+
+    // Keep the unfinished line for the next read
+    memmove(output->data, output->data + end, output->length - end);
+    output->length -= end;
+}
+
+/**
+ * Queues the commands of a batch line whose dependencies have all finished
+ * @param line_index Index of the line in BATCH
+ */
+void batch_line_ready(size_t line_index)
+{
+    struct batch_line *line = &BATCH.lines[line_index];
+
+    clock_gettime(CLOCK_MONOTONIC, &line->ready_at);
+    line->unfinished_jobs = line->command_count;
+    for (size_t i = 0; i < line->command_count; i++)
+    {
+        if (job_table_add(line->commands[i]))
+        {
+            fprintf(ERROUTPUT, ERROR_MSG);
+            line->unfinished_jobs--;
+            continue;
+        }
+        JOBS.jobs[JOBS.count - 1].batch_line = line_index;
+    }
+}
+
+/**
+ * Records that a job has finished, releasing the batch lines that waited for
+ * its line in --parallel-batch mode
+ * @param job_index Index of the job in JOBS
+ *
+ * Successors are appended to the job queue, so the table may move.
+ */
+void batch_job_done(size_t job_index)
+{
+    size_t line_index = JOBS.jobs[job_index].batch_line;
+    if (line_index == SIZE_MAX || --BATCH.lines[line_index].unfinished_jobs > 0)
+    {
+        return;
+    }
+
+    // Out of order, a line's latency starts once it no longer waits for others
+    struct batch_line *line = &BATCH.lines[line_index];
+    histogram_record_since(&STATS.dispatch, &line->ready_at);
+    for (size_t i = 0; i < line->successor_count; i++)
+    {
+        if (--BATCH.lines[line->successors[i]].waiting_for == 0)
+        {
+            batch_line_ready(line->successors[i]);
+        }
+    }
+}
+
+/**
+ * Starts a timerfd that fires once after a delay
+ * @param timer_fd The timer
+ * @param seconds Delay in seconds
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE otherwise
+ */
+int arm_timer(int timer_fd, double seconds)
+{
+    struct itimerspec delay = {.it_value = {.tv_sec = (time_t)seconds}};
+    delay.it_value.tv_nsec = (long)((seconds - (double)delay.it_value.tv_sec) * 1e9);
+    if (delay.it_value.tv_sec == 0 && delay.it_value.tv_nsec == 0)
+    {
+        delay.it_value.tv_nsec = 1; // A zero delay would disarm the timer
+    }
+    return timerfd_settime(timer_fd, 0, &delay, NULL) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Starts the timer that ends a job running longer than its time limit
+ * @param job_index Index of the job in JOBS (its children are in their own
+ * process group)
+ * @param seconds The job's time limit
+ */
+void job_timeout_start(size_t job_index, double seconds)
+{
+    struct job *job = &JOBS.jobs[job_index];
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = EVENT_DATA(EVENT_JOB_TIMEOUT, job_index)};
+
+    job->timeout_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (job->timeout_fd != -1 &&
+        (arm_timer(job->timeout_fd, seconds) || epoll_ctl(EVENTS.epoll_fd, EPOLL_CTL_ADD, job->timeout_fd, &event)))
+    {
+        close(job->timeout_fd);
+        job->timeout_fd = -1;
+    }
+    if (job->timeout_fd == -1)
+    {
+        // The job runs, but without its time limit
+        fprintf(ERROUTPUT, ERROR_MSG);
+    }
+}
+
+/**
+ * Signals a job whose timer expired
+ * @param job_index Index of the job in JOBS
+ *
+ * The job's process group first gets SIGTERM (and SIGCONT, so stopped
+ * processes can act on it); if it is still around JOB_TIMEOUT_KILL_SECONDS
+ * later, SIGKILL. The timer is closed when the job finishes, so the group
+ * is never signalled once its processes are gone.
+ */
+void job_timeout_expired(size_t job_index)
+{
+    struct job *job = &JOBS.jobs[job_index];
+    uint64_t expirations;
+
+    // The job may have finished earlier in the same batch of events
+    if (job->timeout_fd == -1 || read(job->timeout_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    {
+        return;
+    }
+
+    if (!job->timed_out)
+    {
+        job->timed_out = true;
+        kill(-job->process_group, SIGTERM);
+        kill(-job->process_group, SIGCONT);
+        arm_timer(job->timeout_fd, JOB_TIMEOUT_KILL_SECONDS);
+    }
+    else
+    {
+        kill(-job->process_group, SIGKILL);
+    }
+}
+
+/**
+ * Checks whether a command starts with the built-in timeout prefix
+ * @param args NULL-terminated arguments of the command
+ * @param seconds Set to the prefix's time limit if there is one
+ * @return true for "timeout DURATION command ...", false otherwise; lines
+ * with options ("timeout -k 1 5 cmd") or without a valid duration are left
+ * to the system's timeout command
+ */
+bool has_timeout_prefix(char **args, double *seconds)
+{
+    return args[0] != NULL && !strcmp(args[0], JOB_TIMEOUT_PREFIX) && args[1] != NULL && args[2] != NULL &&
+           !parse_duration(args[1], seconds);
+}
+
+/**
+ * Removes a timeout prefix from a job's command
+ * @param args The job's arguments; moved past "timeout DURATION" if present
+ * @param seconds Set to the prefix's time limit, left alone without a prefix
+ */
+void strip_timeout_prefix(char ***args, double *seconds)
+{
+    if (has_timeout_prefix(*args, seconds))
+    {
+        *args += 2;
+    }
+}
+
+/**
+ * Marks a job done once all of its processes are reaped and its captured
+ * output has reached end of file
+ * @param job_index Index of the job in JOBS
+ */
+void finish_job(size_t job_index)
+{
+    struct job *job = &JOBS.jobs[job_index];
+
+    if (job->state != JOB_RUNNING || job->running_processes > 0 || job->open_outputs > 0)
+    {
+        return;
+    }
+
+    if (OUTPUT_MODE == OUTPUT_GROUP)
+    {
+        job_output_flush(job);
+    }
+    else
+    {
+        job_output_release(job);
+    }
+    jobserver_release(job->jobserver_token);
+    if (job->affinity_unit != SIZE_MAX)
+    {
+        AFFINITY.units[job->affinity_unit].running--;
+    }
+    if (job->timeout_fd != -1)
+    {
+        close(job->timeout_fd);
+        job->timeout_fd = -1;
+    }
+    if (job->timed_out)
+    {
+        fprintf(ERROUTPUT, TIMEOUT_MSG);
+    }
+    job->state = JOB_DONE;
+    JOBS.running--;
+    batch_job_done(job_index);
+}
+
+/**
+ * Reads what is available from one of a job's capture pipes
+ * @param job_index Index of the job in JOBS
+ * @param stream 0 for standard output, 1 for standard error
+ *
+ * Called when the pipe is readable, so the single read() never blocks. End
+ * of file closes the pipe and may finish the job.
+ */
+void read_job_output(size_t job_index, int stream)
+{
+    struct job *job = &JOBS.jobs[job_index];
+    struct output_buffer *output = &job->output[stream];
+
+    if (output->read_fd == -1)
+    {
+        return; // Already drained earlier in the same batch of events
+    }
+
+    // Always leave room for a whole chunk
+    if (output->capacity - output->length < STREAM_CHUNK)
+    {
+        size_t new_capacity = output->capacity ? output->capacity * 2 : STREAM_CHUNK;
+        while (new_capacity - output->length < STREAM_CHUNK)
+        {
+            new_capacity *= 2;
+        }
+        char *new_data = realloc(output->data, new_capacity);
+        if (new_data != NULL)
+        {
+            output->data = new_data;
+            output->capacity = new_capacity;
+        }
+        else
+        {
+            // Make room by spilling what is buffered already
+            job_output_spill(output);
+        }
+    }
+
+    ssize_t count = -1;
+    if (output->capacity - output->length >= STREAM_CHUNK)
+    {
+        count = read(output->read_fd, output->data + output->length, STREAM_CHUNK);
+    }
+    else
+    {
+        // Nowhere to store the output; stop capturing this stream
+        fprintf(ERROUTPUT, ERROR_MSG);
+        errno = ENOMEM;
+    }
+
+    if (count > 0)
+    {
+        output->length += count;
+        if (OUTPUT_MODE == OUTPUT_TAG)
+        {
+            job_output_emit_lines(job_index, stream, false);
+        }
+        else if (output->length >= OUTPUT_SPILL_THRESHOLD)
+        {
+            job_output_spill(output);
+        }
+        return;
+    }
+    if (count == -1 && (errno == EINTR || errno == EAGAIN))
+    {
+        return;
+    }
+
+    // Every writer has closed its end (or the pipe failed)
+    if (OUTPUT_MODE == OUTPUT_TAG)
+    {
+        job_output_emit_lines(job_index, stream, true);
+    }
+    close(output->read_fd);
+    output->read_fd = -1;
+    job->open_outputs--;
+    finish_job(job_index);
+}
+
+/**
+ * Records that a child has been reaped, finishing its job with the last one
+ * @param process The process that exited
+ * @param status Wait status of the child
+ * @param usage Resources used by the child, or NULL if unknown
+ */
+void finish_process(struct process *process, int status, const struct rusage *usage)
+{
+    struct job *job = &JOBS.jobs[process->job];
+
+    if (process->pidfd != -1)
+    {
+        // Closing the pidfd also removes it from the epoll set
+        close(process->pidfd);
+        process->pidfd = -1;
+    }
+    process->status = status;
+    process->running = false;
+    trace_span(process->args[0], "process", process->started_at, (long)process->pid, process->args[0]);
+
+    // A pipeline reports the status of its last stage
+    if (process == &PROCESSES.processes[job->first_process + job->process_count - 1])
+    {
+        job->status = status;
+    }
+
+    // A pipeline's stages add up, except for memory: they run side by side
+    if (usage != NULL)
+    {
+        timeradd(&job->usage.ru_utime, &usage->ru_utime, &job->usage.ru_utime);
+        timeradd(&job->usage.ru_stime, &usage->ru_stime, &job->usage.ru_stime);
+        job->usage.ru_maxrss = usage->ru_maxrss > job->usage.ru_maxrss ? usage->ru_maxrss : job->usage.ru_maxrss;
+        job->usage.ru_nvcsw += usage->ru_nvcsw;
+        job->usage.ru_nivcsw += usage->ru_nivcsw;
+    }
+
+    if (--job->running_processes == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &job->finished_at);
+        histogram_record(&STATS.runtime, elapsed_ns(&job->started_at, &job->finished_at));
+    }
+    finish_job(process->job);
+}
+
+/**
+ * Finds the running process with a given process ID
+ * @param pid Process ID of the child
+ * @return The process, or NULL if the child doesn't belong to the current line
+ */
+struct process *find_running_process(pid_t pid)
+{
+    for (size_t i = 0; i < PROCESSES.count; i++)
+    {
+        if (PROCESSES.processes[i].running && PROCESSES.processes[i].pid == pid)
+        {
+            return &PROCESSES.processes[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Reaps every child that has already exited, without blocking
+ */
+void reap_exited_children()
+{
+    int status;
+    pid_t pid;
+    struct rusage usage;
+
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0)
+    {
+        struct process *process = find_running_process(pid);
+        if (process != NULL)
+        {
+            finish_process(process, status, &usage);
+        }
+    }
+}
+
+/**
+ * Registers a newly started process with the event loop
+ * @param process The process that was just started
+ */
+void watch_process(struct process *process)
+{
+    if (!EVENTS.use_pidfd)
+    {
+        return; // Reaped through SIGCHLD or waitpid() instead
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = EVENT_DATA(EVENT_CHILD_EXIT, process - PROCESSES.processes)};
+    process->pidfd = open_pidfd(process->pid);
+    if (process->pidfd == -1 || epoll_ctl(EVENTS.epoll_fd, EPOLL_CTL_ADD, process->pidfd, &event))
+    {
+        // Out of descriptors: this child can only be waited for directly
+        int status = 0;
+        struct rusage usage;
+        bool reaped = wait4(process->pid, &status, 0, &usage) == process->pid;
+        finish_process(process, status, reaped ? &usage : NULL);
+    }
+}
+
+/**
+ * Blocks until at least one event arrives and handles all ready events
+ *
+ * Children are reaped in the order they finish, whatever order they were
+ * started in.
+ */
+void process_events()
+{
+    struct epoll_event events[EVENT_BATCH];
+    int status;
+    struct rusage usage;
+
+    if (EVENTS.epoll_fd == -1)
+    {
+        // No event loop: wait for any child and match it to its process
+        struct timespec start = trace_clock();
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        trace_span("wait", "shell", start, TRACE.pid, NULL);
+        struct process *process = pid > 0 ? find_running_process(pid) : NULL;
+        if (process != NULL)
+        {
+            finish_process(process, status, &usage);
+        }
+        else if (pid <= 0)
+        {
+            // No children left; nothing more to wait for
+            for (size_t i = 0; i < PROCESSES.count; i++)
+            {
+                if (PROCESSES.processes[i].running)
+                {
+                    finish_process(&PROCESSES.processes[i], 0, NULL);
+                }
+            }
+        }
+        return;
+    }
+
+    struct timespec start = trace_clock();
+    int ready = epoll_wait(EVENTS.epoll_fd, events, EVENT_BATCH, -1);
+    trace_span("wait", "shell", start, TRACE.pid, NULL);
+    for (int i = 0; i < ready; i++)
+    {
+        switch (EVENT_SOURCE(events[i].data.u64))
+        {
+        case EVENT_CHILD_EXIT:
+        {
+            struct process *process = &PROCESSES.processes[EVENT_INDEX(events[i].data.u64)];
+            if (process->running && wait4(process->pid, &status, WNOHANG, &usage) == process->pid)
+            {
+                finish_process(process, status, &usage);
+            }
+            break;
+        }
+        case EVENT_SIGCHLD:
+        {
+            // Signals may be coalesced, so reap everything that has exited
+            struct signalfd_siginfo info;
+            while (read(EVENTS.signal_fd, &info, sizeof(info)) == sizeof(info))
+            {
+            }
+            reap_exited_children();
+            break;
+        }
+        case EVENT_JOB_OUTPUT:
+        {
+            size_t index = EVENT_INDEX(events[i].data.u64);
+            read_job_output(index / 2, (int)(index % 2));
+            break;
+        }
+        case EVENT_LOAD_TIMER:
+        {
+            // The scheduler checks the load again after this batch
+            uint64_t expirations;
+            if (read(LOAD.timer_fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+            {
+                LOAD.timer_armed = false;
+            }
+            break;
+        }
+        case EVENT_JOB_TIMEOUT:
+            job_timeout_expired(EVENT_INDEX(events[i].data.u64));
+            break;
+        case EVENT_JOBSERVER:
+            // The scheduler takes the token; stop watching until it has to
+            // wait again
+            epoll_ctl(EVENTS.epoll_fd, EPOLL_CTL_DEL, JOBSERVER.read_fd, NULL);
+            JOBSERVER.waiting = false;
+            break;
+        }
+    }
+}
+
+/**
+ * Checks whether the scheduler may start another job
+ * @return true if fewer than JOBS_LIMIT jobs are running
+ */
+bool job_slot_available()
+{
+    return JOBS_LIMIT == 0 || JOBS.running < JOBS_LIMIT;
+}
+
+/**
+ * Reads a small text file, such as one from /proc or /sys
+ * @param file_path File to read
+ * @param buffer Set to the NUL-terminated contents
+ * @param size Size of buffer; longer files are cut
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the file is missing or empty
+ */
+int read_small_file(const char *file_path, char *buffer, size_t size)
+{
+    int file_descriptor = open(file_path, O_RDONLY | O_CLOEXEC);
+    if (file_descriptor == -1)
+    {
+        return EXIT_FAILURE;
+    }
+    ssize_t length = read(file_descriptor, buffer, size - 1);
+    close(file_descriptor);
+    if (length <= 0)
+    {
+        return EXIT_FAILURE;
+    }
+    buffer[length] = '\0';
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Reads a number from a /proc file
+ * @param file_path File to read
+ * @param key Text the number follows (e.g. "some avg10="), or NULL for the
+ * first number in the file
+ * @param value Set to the number
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the file or key is missing
+ */
+int read_proc_number(const char *file_path, const char *key, double *value)
+{
+    char buffer[256];
+    if (read_small_file(file_path, buffer, sizeof(buffer)))
+    {
+        return EXIT_FAILURE;
+    }
+
+    const char *number = buffer;
+    if (key != NULL)
+    {
+        number = strstr(buffer, key);
+        if (number == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        number += strlen(key);
+    }
+
+    char *end;
+    *value = strtod(number, &end);
+    return end == number ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+ * Checks whether any load limit is exceeded
+ * @return true if the load average or a pressure reading is above its limit
+ *
+ * Readings are reused for LOAD_CACHE_NS so starting many jobs in a row
+ * doesn't reread /proc for each of them. Missing files (no PSI support)
+ * never hold jobs back.
+ */
+bool load_exceeded()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ns = (now.tv_sec - LOAD.checked_at.tv_sec) * 1000000000L + (now.tv_nsec - LOAD.checked_at.tv_nsec);
+    if ((LOAD.checked_at.tv_sec != 0 || LOAD.checked_at.tv_nsec != 0) && elapsed_ns < LOAD_CACHE_NS)
+    {
+        return LOAD.overloaded;
+    }
+    LOAD.checked_at = now;
+
+    double reading;
+    LOAD.overloaded = (LOAD.max_load > 0 && !read_proc_number("/proc/loadavg", NULL, &reading) &&
+                       reading > LOAD.max_load) ||
+                      (LOAD.max_cpu_pressure > 0 && !read_proc_number("/proc/pressure/cpu", "some avg10=", &reading) &&
+                       reading > LOAD.max_cpu_pressure) ||
+                      (LOAD.max_memory_pressure > 0 &&
+                       !read_proc_number("/proc/pressure/memory", "some avg10=", &reading) &&
+                       reading > LOAD.max_memory_pressure);
+    return LOAD.overloaded;
+}
+
+/**
+ * Checks whether the load allows starting another job
+ * @return true if no load limit is set or exceeded, or nothing is running
+ *
+ * A job is always admitted when none is running, so the shell makes progress
+ * on a busy host. Otherwise a held-back scheduler is woken by the next job
+ * that finishes or by a timer after LOAD_RECHECK_SECONDS.
+ */
+bool load_admits()
+{
+    if ((LOAD.max_load <= 0 && LOAD.max_cpu_pressure <= 0 && LOAD.max_memory_pressure <= 0) ||
+        JOBS.running == 0 || !load_exceeded())
+    {
+        return true;
+    }
+
+    if (LOAD.timer_fd == -1 && EVENTS.epoll_fd != -1)
+    {
+        struct epoll_event event = {.events = EPOLLIN, .data.u64 = EVENT_DATA(EVENT_LOAD_TIMER, 0)};
+        LOAD.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (LOAD.timer_fd != -1 && epoll_ctl(EVENTS.epoll_fd, EPOLL_CTL_ADD, LOAD.timer_fd, &event))
+        {
+            close(LOAD.timer_fd);
+            LOAD.timer_fd = -1;
+        }
+    }
+    if (LOAD.timer_fd != -1 && !LOAD.timer_armed)
+    {
+        struct itimerspec delay = {.it_value = {.tv_sec = LOAD_RECHECK_SECONDS}};
+        LOAD.timer_armed = !timerfd_settime(LOAD.timer_fd, 0, &delay, NULL);
+    }
+    return false;
+}
+
+/**
+ * Parses a kernel CPU list such as "0-3,8-11"
+ * @param text The list, as found in /sys (may end with a newline)
+ * @param set Set to the listed CPUs
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the list is malformed
+ */
+int parse_cpu_list(const char *text, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    const char *position = text;
+    while (*position != '\0' && *position != '\n')
+    {
+        char *end;
+        unsigned long first = strtoul(position, &end, 10);
+        unsigned long last = first;
+        if (end == position)
+        {
+            return EXIT_FAILURE;
+        }
+        if (*end == '-')
+        {
+            position = end + 1;
+            last = strtoul(position, &end, 10);
+            if (end == position || last < first)
+            {
+                return EXIT_FAILURE;
+            }
+        }
+        if (*end != ',' && *end != '\0' && *end != '\n')
+        {
+            return EXIT_FAILURE;
+        }
+
+        for (unsigned long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+        {
+            CPU_SET(cpu, set);
+        }
+        position = *end == ',' ? end + 1 : end;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Reads the CPU list of a NUMA node
+ * @param node Node number
+ * @param set Set to the node's CPUs
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if the node doesn't exist
+ */
+int read_node_cpus(int node, cpu_set_t *set)
+{
+    char file_path[64];
+    char buffer[4096];
+    snprintf(file_path, sizeof(file_path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (read_small_file(file_path, buffer, sizeof(buffer)))
+    {
+        return EXIT_FAILURE;
+    }
+    return parse_cpu_list(buffer, set);
+}
+
+/**
+ * Finds the highest NUMA node number
+ * @return Highest node in /sys/devices/system/node, or -1 without NUMA
+ * information
+ */
+int highest_numa_node()
+{
+    DIR *directory = opendir("/sys/devices/system/node");
+    if (directory == NULL)
+    {
+        return -1;
+    }
+
+    int highest = -1;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL)
+    {
+        char *end;
+        if (strncmp(entry->d_name, "node", 4))
+        {
+            continue;
+        }
+        long node = strtol(entry->d_name + 4, &end, 10);
+        if (end != entry->d_name + 4 && *end == '\0' && node > highest && node < INT_MAX)
+        {
+            highest = (int)node;
+        }
+    }
+    closedir(directory);
+    return highest;
+}
+
+/**
+ * Orders CPUs for placement under the selected policy (qsort() callback)
+ * @param left First struct affinity_cpu
+ * @param right Second struct affinity_cpu
+ * @return Negative, zero or positive as left comes before, with or after right
+ *
+ * Compact keeps the threads of a core, then the cores of a node together.
+ * Scatter takes one thread of every core first and alternates between
+ * nodes. Round-robin follows the CPU numbers.
+ */
+int compare_affinity_cpus(const void *left, const void *right)
+{
+    const struct affinity_cpu *a = left;
+    const struct affinity_cpu *b = right;
+    int left_keys[4] = {a->cpu, 0, 0, 0};
+    int right_keys[4] = {b->cpu, 0, 0, 0};
+
+    if (AFFINITY.policy == AFFINITY_COMPACT)
+    {
+        int compact_left[4] = {a->node, a->core, a->cpu, 0};
+        int compact_right[4] = {b->node, b->core, b->cpu, 0};
+        memcpy(left_keys, compact_left, sizeof(left_keys));
+        memcpy(right_keys, compact_right, sizeof(right_keys));
+    }
+    else if (AFFINITY.policy == AFFINITY_SCATTER)
+    {
+        int scatter_left[4] = {a->thread, a->node_rank, a->node, a->cpu};
+        int scatter_right[4] = {b->thread, b->node_rank, b->node, b->cpu};
+        memcpy(left_keys, scatter_left, sizeof(left_keys));
+        memcpy(right_keys, scatter_right, sizeof(right_keys));
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        if (left_keys[i] != right_keys[i])
+        {
+            return left_keys[i] < right_keys[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Builds one unit per NUMA node that has CPUs the shell may use
+ * @param highest_node Highest node number, or -1 without NUMA information
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ */
+int affinity_add_node_units(int highest_node)
+{
+    AFFINITY.units = malloc((highest_node >= 0 ? highest_node + 1 : 1) * sizeof(struct affinity_unit));
+    if (AFFINITY.units == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+
+    for (int node = 0; node <= highest_node; node++)
+    {
+        struct affinity_unit *unit = &AFFINITY.units[AFFINITY.unit_count];
+        if (read_node_cpus(node, &unit->cpus))
+        {
+            continue;
+        }
+        CPU_AND(&unit->cpus, &unit->cpus, &AFFINITY.allowed);
+        unit->capacity = CPU_COUNT(&unit->cpus);
+        unit->running = 0;
+        if (unit->capacity > 0)
+        {
+            AFFINITY.unit_count++;
+        }
+    }
+
+    // Without node information the whole machine is one node
+    if (AFFINITY.unit_count == 0)
+    {
+        AFFINITY.units[0].cpus = AFFINITY.allowed;
+        AFFINITY.units[0].capacity = CPU_COUNT(&AFFINITY.allowed);
+        AFFINITY.units[0].running = 0;
+        AFFINITY.unit_count = 1;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Builds one unit per CPU the shell may use, in the policy's order
+ * @param highest_node Highest node number, or -1 without NUMA information
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ */
+int affinity_add_cpu_units(int highest_node)
+{
+    size_t count = CPU_COUNT(&AFFINITY.allowed);
+    struct affinity_cpu *cpus = malloc(count * sizeof(*cpus));
+    AFFINITY.units = malloc(count * sizeof(struct affinity_unit));
+    if (cpus == NULL || AFFINITY.units == NULL)
+    {
+        free(cpus);
+        free(AFFINITY.units);
+        AFFINITY.units = NULL;
+        return EXIT_FAILURE;
+    }
+
+    size_t filled = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && filled < count; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &AFFINITY.allowed))
+        {
+            continue;
+        }
+        struct affinity_cpu *entry = &cpus[filled++];
+        entry->cpu = cpu;
+        entry->node = 0;
+        entry->core = cpu;
+        entry->thread = 0;
+        entry->node_rank = 0;
+
+        // Hardware threads sharing the CPU's core
+        char file_path[96];
+        char buffer[4096];
+        cpu_set_t siblings;
+        snprintf(file_path, sizeof(file_path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        if (read_small_file(file_path, buffer, sizeof(buffer)) || parse_cpu_list(buffer, &siblings))
+        {
+            continue;
+        }
+        for (int sibling = 0; sibling < cpu; sibling++)
+        {
+            if (CPU_ISSET(sibling, &siblings))
+            {
+                entry->core = entry->core < sibling ? entry->core : sibling;
+                entry->thread += CPU_ISSET(sibling, &AFFINITY.allowed) ? 1 : 0;
+            }
+        }
+    }
+
+    for (int node = 0; node <= highest_node; node++)
+    {
+        cpu_set_t node_cpus;
+        if (read_node_cpus(node, &node_cpus))
+        {
+            continue;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            if (CPU_ISSET(cpus[i].cpu, &node_cpus))
+            {
+                cpus[i].node = node;
+            }
+        }
+    }
+
+    // Rank within the node, so scatter can alternate between nodes
+    for (size_t i = 0; i < count; i++)
+    {
+        for (size_t j = 0; j < i; j++)
+        {
+            if (cpus[j].node == cpus[i].node && cpus[j].thread == cpus[i].thread)
+            {
+                cpus[i].node_rank++;
+            }
+        }
+    }
+
+    qsort(cpus, count, sizeof(*cpus), compare_affinity_cpus);
+    for (size_t i = 0; i < count; i++)
+    {
+        struct affinity_unit *unit = &AFFINITY.units[i];
+        CPU_ZERO(&unit->cpus);
+        CPU_SET(cpus[i].cpu, &unit->cpus);
+        unit->capacity = 1;
+        unit->running = 0;
+    }
+    AFFINITY.unit_count = count;
+    free(cpus);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Prepares job placement for --affinity and --numa
+ *
+ * Only the CPUs the shell itself may run on (e.g. under taskset or a
+ * cpuset) are used. --numa alone spreads jobs over the nodes. If the
+ * topology can't be read, jobs are not pinned.
+ */
+void affinity_init()
+{
+    if (AFFINITY.numa && AFFINITY.policy == AFFINITY_NONE)
+    {
+        AFFINITY.policy = AFFINITY_SCATTER;
+    }
+    if (AFFINITY.policy == AFFINITY_NONE)
+    {
+        return;
+    }
+
+    if (sched_getaffinity(0, sizeof(AFFINITY.allowed), &AFFINITY.allowed) || CPU_COUNT(&AFFINITY.allowed) == 0)
+    {
+        AFFINITY.policy = AFFINITY_NONE;
+        return;
+    }
+
+    int highest_node = highest_numa_node();
+    if (AFFINITY.numa ? affinity_add_node_units(highest_node) : affinity_add_cpu_units(highest_node))
+    {
+        AFFINITY.policy = AFFINITY_NONE;
+    }
+}
+
+/**
+ * Chooses the unit a job is pinned to
+ * @param job_index Index of the job in JOBS
+ * @return Index in AFFINITY.units, or SIZE_MAX if jobs are not pinned
+ *
+ * Compact takes the first unit with a free CPU, scatter the least loaded
+ * unit for its size (the first on a tie); once every CPU is busy both share
+ * the load evenly.
+ */
+size_t affinity_place(size_t job_index)
+{
+    if (AFFINITY.policy == AFFINITY_NONE || AFFINITY.unit_count == 0)
+    {
+        return SIZE_MAX;
+    }
+    if (AFFINITY.policy == AFFINITY_ROUND_ROBIN)
+    {
+        return job_index % AFFINITY.unit_count;
+    }
+
+    size_t best = 0;
+    for (size_t i = 0; i < AFFINITY.unit_count; i++)
+    {
+        const struct affinity_unit *unit = &AFFINITY.units[i];
+        const struct affinity_unit *chosen = &AFFINITY.units[best];
+        if (AFFINITY.policy == AFFINITY_COMPACT && unit->running < unit->capacity)
+        {
+            return i;
+        }
+        if (unit->running * chosen->capacity < chosen->running * unit->capacity)
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+/**
+ * Splits a command into pipeline stages at each PIPE_DELIM
+ * @param args NULL-terminated arguments of the command (modified in place)
+ * @param stage_count Set to the number of stages
+ * @return Array of stages allocated from LINE_ARENA, or NULL if a stage is
+ * empty (e.g. "ls |") or memory couldn't be allocated
+ */
+char ***split_pipeline(char **args, size_t *stage_count)
+{
+    size_t count = 1;
+    for (size_t i = 0; args[i] != NULL; i++)
+    {
+        if (!strcmp(args[i], PIPE_DELIM))
+        {
+            count++;
+        }
+    }
+
+    char ***stages = arena_alloc(&LINE_ARENA, count * sizeof(*stages));
+    if (stages == NULL)
+    {
+        return NULL;
+    }
+
+    size_t stage = 0;
+    stages[0] = args;
+    for (size_t i = 0; args[i] != NULL; i++)
+    {
+        if (!strcmp(args[i], PIPE_DELIM))
+        {
+            // Terminate the current stage in place and start the next one
+            args[i] = NULL;
+            stages[++stage] = &args[i + 1];
+        }
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (stages[i][0] == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    *stage_count = count;
+    return stages;
+}
+
+/**
+ * Starts every stage of a pipeline, connected by close-on-exec pipes
+ * @param job Index of the owning job in JOBS
+ * @param stages Stages of the pipeline
+ * @param stage_count Number of stages (at least two)
+ * @param output_fd Standard output of the last stage, or -1 to inherit it
+ * @param error_fd Standard error of every stage, or -1 to inherit it
+ *
+ * All stages are validated and resolved before any of them is started, then
+ * launched together so data streams between them without temporary files.
+ */
+void start_pipeline(size_t job, char ***stages, size_t stage_count, int output_fd, int error_fd)
+{
+    struct redirection_list *redirections = arena_alloc(&LINE_ARENA, stage_count * sizeof(*redirections));
+    const char **executable_paths = arena_alloc(&LINE_ARENA, stage_count * sizeof(char *));
+    if (redirections == NULL || executable_paths == NULL)
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return;
+    }
+
+    for (size_t i = 0; i < stage_count; i++)
+    {
+        // cat and tee stages run as built-ins and need no executable
+        if (is_stream_builtin(stages[i]))
+        {
+            executable_paths[i] = NULL;
+        }
+        else if (prepare_command(stages[i], &redirections[i], &executable_paths[i]))
+        {
+            return;
+        }
+    }
+
+    int input_fd = -1; // Read end of the pipe from the previous stage
+    for (size_t i = 0; i < stage_count; i++)
+    {
+        int pipe_fds[2] = {-1, -1};
+        pid_t process_id = 0;
+
+        if (i < stage_count - 1 && pipe2(pipe_fds, O_CLOEXEC))
+        {
+            fprintf(ERROUTPUT, ERROR_MSG);
+            break;
+        }
+
+        // The last stage writes wherever the job's output goes
+        int stage_output_fd = i < stage_count - 1 ? pipe_fds[1] : output_fd;
+        if (executable_paths[i] == NULL)
+        {
+            fork_stream_builtin(stages[i], input_fd, stage_output_fd, error_fd, &process_id);
+        }
+        else
+        {
+            launch_command(stages[i], executable_paths[i], &redirections[i], input_fd, stage_output_fd,
+                           error_fd, &process_id);
+        }
+
+        // The shell keeps only the read end for the next stage
+        if (input_fd != -1)
+        {
+            close(input_fd);
+        }
+        if (pipe_fds[1] != -1)
+        {
+            close(pipe_fds[1]);
+        }
+        input_fd = pipe_fds[0];
 
-// Global file handles for shell I/O operations
-FILE *OUTPUT;    // Output stream
-FILE *INPUT;     // Input stream
-FILE *ERROUTPUT; // Error stream
+        if (process_id > 0 && process_table_add(job, process_id, stages[i]))
+        {
+            // Can't track the child; wait for it once the others are started
+            fprintf(ERROUTPUT, ERROR_MSG);
+        }
+    }
 
-bool SHELL_RUNNING = true;  // Controls the main shell loop execution
+    if (input_fd != -1)
+    {
+        close(input_fd);
+    }
+}
 
 /**
- * Initializes default path directories
+ * Starts the next queued job
+ *
+ * Built-ins run in the shell as soon as they reach the front of the queue,
+ * so they keep their position relative to the commands around them.
  */
-void initialize_path()
+void start_next_job()
 {
-    PATH[0] = strdup("/bin");
-    PATH[1] = strdup("/usr/bin");
-    PATH[2] = NULL;
+    size_t job_index = JOBS.next_pending++;
+    struct job *job = &JOBS.jobs[job_index];
+    size_t stage_count;
+    double timeout = JOB_TIMEOUT;
+    strip_timeout_prefix(&job->args, &timeout);
+    char ***stages = split_pipeline(job->args, &stage_count);
+
+    // With --group-output or --tag the job's children write into pipes
+    // drained by the event loop; if they can't be set up the job writes
+    // directly
+    int output_fds[2] = {-1, -1};
+    if (OUTPUT_MODE != OUTPUT_SHARED && stages != NULL)
+    {
+        job_output_open(job_index, output_fds);
+    }
+
+    // With --affinity the children inherit the unit's CPUs from the shell,
+    // which moves onto them only while it starts the job
+    size_t unit = stages != NULL ? affinity_place(job_index) : SIZE_MAX;
+    if (unit != SIZE_MAX && sched_setaffinity(0, sizeof(cpu_set_t), &AFFINITY.units[unit].cpus))
+    {
+        unit = SIZE_MAX;
+    }
+
+    // A job with a time limit gets a process group of its own, so the
+    // signals reach everything it started
+    LAUNCH_PROCESS_GROUP = timeout > 0 ? 0 : -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &job->started_at);
+    STATS.commands++;
+    job->first_process = PROCESSES.count;
+    if (timeout > 0 && EVENTS.epoll_fd == -1)
+    {
+        // Time limits are enforced by the event loop; without it a hung
+        // command could never be stopped, so it isn't started
+        fprintf(ERROUTPUT, ERROR_MSG);
+    }
+    else if (stages == NULL)
+    {
+        // Empty pipeline stage
+        fprintf(ERROUTPUT, ERROR_MSG);
+    }
+    else if (stage_count == 1)
+    {
+        pid_t process_id;
+        if (!execute_command(job->args, output_fds[0], output_fds[1], &process_id) && process_id > 0 &&
+            process_table_add(job_index, process_id, job->args))
+        {
+            fprintf(ERROUTPUT, ERROR_MSG);
+        }
+    }
+    else
+    {
+        start_pipeline(job_index, stages, stage_count, output_fds[0], output_fds[1]);
+    }
+
+    if (unit != SIZE_MAX)
+    {
+        sched_setaffinity(0, sizeof(AFFINITY.allowed), &AFFINITY.allowed);
+    }
+    pid_t process_group = LAUNCH_PROCESS_GROUP > 0 ? LAUNCH_PROCESS_GROUP : 0;
+    LAUNCH_PROCESS_GROUP = -1;
+
+    // The 'parallel' built-in may have grown the job table
+    job = &JOBS.jobs[job_index];
+
+    // Only the children keep the write ends of the capture pipes open
+    for (int stream = 0; stream < 2; stream++)
+    {
+        if (output_fds[stream] != -1)
+        {
+            close(output_fds[stream]);
+        }
+    }
+
+    job->process_count = PROCESSES.count - job->first_process;
+    if (job->process_count == 0)
+    {
+        // Built-ins and failed commands don't leave a child behind
+        job_output_release(job);
+        jobserver_release(job->jobserver_token);
+        job->state = JOB_DONE;
+        batch_job_done(job_index);
+        return;
+    }
+
+    job->running_processes = job->process_count;
+    job->state = JOB_RUNNING;
+    JOBS.running++;
+    if (unit != SIZE_MAX)
+    {
+        job->affinity_unit = unit;
+        AFFINITY.units[unit].running++;
+    }
+    if (process_group != 0)
+    {
+        job->process_group = process_group;
+        job_timeout_start(job_index, timeout);
+    }
+
+    // Watch the children only now, so a job can't finish half-started (the
+    // job table may move once it does)
+    for (size_t i = job->first_process, end = PROCESSES.count; i < end; i++)
+    {
+        watch_process(&PROCESSES.processes[i]);
+    }
 }
 
 /**
- * Executes the built-in 'cd' (change directory) command
- * @param args Array of command arguments where args[0] is "cd" and args[1] is
- * the target directory
- * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ * Records the usage of every command of the line that started a process
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ *
+ * The records replace those of the previous line (lines of built-ins only
+ * keep them) and are written to USAGE_REPORT_FD if set.
  */
-int execute_cd(char **args)
+int record_job_usage()
 {
-    if (!strcmp(args[0], "cd"))
+    size_t count = 0;
+    for (size_t i = 0; i < JOBS.count; i++)
     {
-        int arg_count = 0;
-        // Count the number of arguments
-        while (args[arg_count] != NULL)
+        count += JOBS.jobs[i].process_count > 0 ? 1 : 0;
+    }
+    if (count == 0)
+    {
+        return EXIT_SUCCESS;
+    }
+    if (count > USAGE.capacity)
+    {
+        struct command_usage *records = realloc(USAGE.records, count * sizeof(*records));
+        if (records == NULL)
         {
-            arg_count++;
+            USAGE.count = 0;
+            return EXIT_FAILURE;
         }
-        // Check if exactly one argument was provided (cd + directory)
-        if (arg_count == 2)
+        USAGE.records = records;
+        USAGE.capacity = count;
+    }
+
+    USAGE.count = 0;
+    for (size_t i = 0; i < JOBS.count; i++)
+    {
+        const struct job *job = &JOBS.jobs[i];
+        if (job->process_count == 0)
         {
-            // Attempt to change directory and report error if it fails
-            if (chdir(args[1]) != 0)
+            continue;
+        }
+        struct command_usage *record = &USAGE.records[USAGE.count++];
+
+        // The first stage's words; a pipeline's other stages are elided
+        size_t length = 0;
+        record->command[0] = '\0';
+        for (size_t word = 0; job->args[word] != NULL && length < sizeof(record->command); word++)
+        {
+            int written = snprintf(record->command + length, sizeof(record->command) - length, "%s%s",
+                                   word > 0 ? " " : "", job->args[word]);
+            length += written > 0 ? (size_t)written : 0;
+        }
+        if (job->process_count > 1 && length < sizeof(record->command))
+        {
+            snprintf(record->command + length, sizeof(record->command) - length, " | ...");
+        }
+
+        record->real_seconds = (double)(job->finished_at.tv_sec - job->started_at.tv_sec) +
+                               (double)(job->finished_at.tv_nsec - job->started_at.tv_nsec) / 1e9;
+        record->user_seconds = (double)job->usage.ru_utime.tv_sec + (double)job->usage.ru_utime.tv_usec / 1e6;
+        record->system_seconds = (double)job->usage.ru_stime.tv_sec + (double)job->usage.ru_stime.tv_usec / 1e6;
+        record->max_rss_kb = job->usage.ru_maxrss;
+        record->voluntary_switches = job->usage.ru_nvcsw;
+        record->involuntary_switches = job->usage.ru_nivcsw;
+        record->status = job->status;
+        record->timed_out = job->timed_out;
+
+        if (USAGE_REPORT_FD != -1)
+        {
+            write_command_usage(USAGE_REPORT_FD, record);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Runs every queued job of the current line and waits for all of them
+ *
+ * At most JOBS_LIMIT jobs run at once; as soon as the event loop reaps one
+ * the next queued command is started. The tables are emptied for the next
+ * line.
+ */
+void run_jobs()
+{
+    struct timespec start = trace_clock();
+    while (JOBS.next_pending < JOBS.count || JOBS.running > 0)
+    {
+        // Fill every free slot from the front of the queue while the load
+        // allows it; beyond the first running job each one needs a jobserver
+        // token
+        int token;
+        while (JOBS.next_pending < JOBS.count && job_slot_available() && load_admits() &&
+               jobserver_acquire(&token))
+        {
+            JOBS.jobs[JOBS.next_pending].jobserver_token = token;
+            start_next_job();
+        }
+
+        if (JOBS.running > 0)
+        {
+            process_events();
+        }
+    }
+
+    if (record_job_usage())
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+    }
+    trace_span("run", "shell", start, TRACE.pid, NULL);
+    JOBS.count = 0;
+    JOBS.next_pending = 0;
+    PROCESSES.count = 0;
+}
+
+/**
+ * Appends a slice to a token vector, doubling its capacity when full
+ * @param tokens The vector to append to
+ * @param type Kind of token
+ * @param offset Start of the token in the line
+ * @param length Length of the token
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ */
+int token_vector_push(struct token_vector *tokens, enum token_type type, size_t offset, size_t length)
+{
+    if (tokens->count == tokens->capacity)
+    {
+        size_t new_capacity = tokens->capacity ? tokens->capacity * 2 : TOKENS_INITIAL_CAPACITY;
+        struct token_slice *new_items = arena_grow(tokens->arena, tokens->items,
+                                                   tokens->capacity * sizeof(*new_items),
+                                                   new_capacity * sizeof(*new_items));
+        if (new_items == NULL)
+        {
+            return EXIT_FAILURE;
+        }
+        tokens->items = new_items;
+        tokens->capacity = new_capacity;
+    }
+
+    tokens->items[tokens->count].type = type;
+    tokens->items[tokens->count].offset = offset;
+    tokens->items[tokens->count++].length = length;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Scans a command line into token slices in a single pass
+ * @param line The input command line (not modified)
+ * @param tokens Vector receiving the slices
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ *
+ * Whitespace separates words, and the operators '&', '|' and the redirections
+ * (see redirection_operator_length) are tokens on their own whether or not
+ * they are surrounded by spaces ("echo>file" yields "echo", ">", "file";
+ * "ls 2>&1" yields "ls", "2>&1"). Each slice refers to the original line by
+ * offset and length, so no token is copied or allocated.
+ */
+int scan_line(const char *line, struct token_vector *tokens)
+{
+    size_t position = 0;
+
+    while (line[position] != '\0')
+    {
+        char current = line[position];
+        size_t operator_length;
+
+        if (strchr(DELIM, current) != NULL)
+        {
+            position++;
+        }
+        else if ((operator_length = redirection_operator_length(line + position)) != 0)
+        {
+            if (token_vector_push(tokens, TOKEN_REDIRECTION, position, operator_length))
             {
-                fprintf(ERROUTPUT, ERROR_MSG);
+                return EXIT_FAILURE;
+            }
+            position += operator_length;
+        }
+        else if (current == PARALLEL_DELIM[0] || current == PIPE_DELIM[0])
+        {
+            enum token_type type = current == PARALLEL_DELIM[0] ? TOKEN_PARALLEL : TOKEN_PIPE;
+            if (token_vector_push(tokens, type, position, 1))
+            {
+                return EXIT_FAILURE;
             }
+            position++;
         }
         else
         {
-            // Wrong number of arguments for cd command
-            fprintf(ERROUTPUT, ERROR_MSG);
+            // A word runs until whitespace, an operator or the end of the line
+            size_t start = position;
+            while (line[position] != '\0' && strchr(WORD_TERMINATORS, line[position]) == NULL)
+            {
+                position++;
+            }
+            if (token_vector_push(tokens, TOKEN_WORD, start, position - start))
+            {
+                return EXIT_FAILURE;
+            }
         }
-        return EXIT_SUCCESS;
     }
-    return EXIT_FAILURE;
+    return EXIT_SUCCESS;
 }
 
 /**
- * Executes the built-in 'exit' command
- * @param args Array of command arguments where args[0] is "exit"
- * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ * Parses a command line into an array of tokens (words)
+ * @param line The input command line to parse
+ * @return Array of string tokens, allocated from LINE_ARENA (valid until the
+ * arena is reset for the next line)
+ *
+ * Words are NUL-terminated in place inside the line and redirection operators
+ * are copied into the arena; '&' and '|' are returned as the constant strings
+ * PARALLEL_DELIM and PIPE_DELIM.
  */
-int execute_exit(char **args)
+char **parse_line(char *line)
 {
-    // Check if command is "exit"
-    if (!strcmp(args[0], "exit"))
+    struct token_vector tokens = {NULL, 0, 0, &LINE_ARENA};
+    char **args = NULL;
+
+    // Scan first so the argument array can be sized exactly
+    if (!scan_line(line, &tokens))
     {
-        if (args[1] != NULL)
+        args = arena_alloc(&LINE_ARENA, (tokens.count + 1) * (sizeof(char *)));
+    }
+
+    // Check if memory allocation succeeded
+    if (!args)
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return NULL;
+    }
+
+    // Walk backwards: terminating a word may overwrite the first character of
+    // the token after it, which has already been materialised by then
+    for (size_t i = tokens.count; i-- > 0;)
+    {
+        const struct token_slice *token = &tokens.items[i];
+        switch (token->type)
         {
-            // Error: exit command should not have any arguments
-            fprintf(stderr, ERROR_MSG);
-            return EXIT_SUCCESS;
+        case TOKEN_WORD:
+            args[i] = line + token->offset;
+            args[i][token->length] = '\0';
+            break;
+        case TOKEN_REDIRECTION:
+            args[i] = arena_alloc(&LINE_ARENA, token->length + 1);
+            if (args[i] == NULL)
+            {
+                fprintf(ERROUTPUT, ERROR_MSG);
+                return NULL;
+            }
+            memcpy(args[i], line + token->offset, token->length);
+            args[i][token->length] = '\0';
+            break;
+        case TOKEN_PARALLEL:
+            args[i] = PARALLEL_DELIM;
+            break;
+        case TOKEN_PIPE:
+            args[i] = PIPE_DELIM;
+            break;
         }
-        else
+    }
+
+    // Null-terminate the array of tokens for easier processing
+    args[tokens.count] = NULL;
+    return args;
+}
+
+/**
+ * Splits the arguments of a line into commands separated by PARALLEL_DELIM
+ * @param args NULL-terminated arguments of the line (modified in place)
+ * @param command_count Set to the number of commands
+ * @return Array of commands allocated from LINE_ARENA, or NULL if memory
+ * couldn't be allocated
+ *
+ * An empty command (e.g. "ls & & pwd") ends the line: only the commands
+ * before it are returned.
+ */
+char ***split_commands(char **args, size_t *command_count)
+{
+    int arg_position = 0;   // Current position in args array
+    int command_start = 0;  // Index of the first argument of the current command
+    size_t count = 0;
+
+    // At most one command per delimiter, plus the last one
+    size_t capacity = 1;
+    for (size_t i = 0; args[i] != NULL; i++)
+    {
+        capacity += !strcmp(args[i], PARALLEL_DELIM);
+    }
+    char ***commands = arena_alloc(&LINE_ARENA, capacity * sizeof(char **));
+    if (commands == NULL)
+    {
+        fprintf(ERROUTPUT, ERROR_MSG);
+        return NULL;
+    }
+
+    while (args[arg_position] != NULL)
+    {
+        // Check if the current argument is a parallel delimiter ('&')
+        if (!strcmp(args[arg_position], PARALLEL_DELIM))
         {
-            // Exit the shell with success status
-            exit(EXIT_SUCCESS);
+            // Handle empty command before delimiter
+            if (arg_position == command_start)
+            {
+                break;
+            }
+
+            // Null-terminate the current command in place
+            args[arg_position] = NULL;
+            commands[count++] = &args[command_start];
+            command_start = arg_position + 1;
         }
+
+        // Move to the next argument
+        arg_position++;
     }
-    return EXIT_FAILURE;
+
+    // Keep the last command if there are any pending arguments
+    if (args[arg_position] == NULL && arg_position > command_start)
+    {
+        commands[count++] = &args[command_start];
+    }
+
+    *command_count = count;
+    return commands;
 }
 
 /**
- * Executes the built-in 'path' command to set search directories
- * @param args Array of command arguments where args[0] is "path" followed by
- * directory paths
- * @return EXIT_SUCCESS if the command was handled, EXIT_FAILURE otherwise
+ * Appends a line index to an arena-backed list, doubling its capacity when full
+ * @param items The list (moved when it grows)
+ * @param count Number of indices in the list
+ * @param capacity Allocated size of the list
+ * @param value Index to append
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
  */
-int execute_path(char **args)
+int index_list_push(size_t **items, size_t *count, size_t *capacity, size_t value)
 {
-    if (!strcmp(args[0], "path"))
+    if (*count == *capacity)
     {
-        // First, clear the existing path by setting all entries to NULL
-        int path_count = 0;
-        while (PATH[path_count] != NULL)
+        size_t new_capacity = *capacity ? *capacity * 2 : 4;
+        size_t *new_items = arena_grow(&LINE_ARENA, *items, *capacity * sizeof(size_t),
+                                       new_capacity * sizeof(size_t));
+        if (new_items == NULL)
         {
-            free(PATH[path_count]); // Free the previously allocated memory
-            PATH[path_count] = NULL;
-            path_count++;
+            return EXIT_FAILURE;
         }
+        *items = new_items;
+        *capacity = new_capacity;
+    }
+    (*items)[(*count)++] = value;
+    return EXIT_SUCCESS;
+}
 
-        // If there are arguments, add each one to the PATH array
-        if (args[1] != NULL)
+/**
+ * Finds the access record of a file, adding one if the file is new
+ * @param files The table of files named since the last barrier
+ * @param name File name as written on the line
+ * @return The record, or NULL if memory couldn't be allocated
+ */
+struct file_access *file_access_find(struct file_access_table *files, const char *name)
+{
+    // Keep at most half of the slots in use
+    if (2 * (files->count + 1) > files->capacity)
+    {
+        size_t new_capacity = files->capacity ? files->capacity * 2 : FILE_ACCESS_INITIAL_CAPACITY;
+        struct file_access *new_slots = arena_alloc(&LINE_ARENA, new_capacity * sizeof(*new_slots));
+        if (new_slots == NULL)
         {
-            path_count = 0;
-            int args_count = 1;
-            while (args[args_count] != NULL && path_count < TOKENS_NUMBER - 1)
+            return NULL;
+        }
+        memset(new_slots, 0, new_capacity * sizeof(*new_slots));
+        for (size_t i = 0; i < files->capacity; i++)
+        {
+            if (files->slots[i].name != NULL)
             {
-                // Create a copy of the path string to avoid issues when args memory is
-                // freed
-                PATH[path_count] = strdup(args[args_count]);
-                path_count++;
-                args_count++;
+                size_t slot = hash_command_name(files->slots[i].name) & (new_capacity - 1);
+                while (new_slots[slot].name != NULL)
+                {
+                    slot = (slot + 1) & (new_capacity - 1);
+                }
+                new_slots[slot] = files->slots[i];
             }
         }
+        files->slots = new_slots;
+        files->capacity = new_capacity;
+    }
 
-        // Ensure the PATH array is NULL-terminated
-        PATH[path_count] = NULL;
-        return EXIT_SUCCESS;
+    size_t slot = hash_command_name(name) & (files->capacity - 1);
+    while (files->slots[slot].name != NULL && strcmp(files->slots[slot].name, name))
+    {
+        slot = (slot + 1) & (files->capacity - 1);
+    }
+
+    struct file_access *access = &files->slots[slot];
+    if (access->name == NULL)
+    {
+        access->name = name;
+        access->last_writer = SIZE_MAX;
+        files->count++;
     }
-    return EXIT_FAILURE;
+    return access;
 }
 
 /**
- * Checks and executes built-in shell commands
- * @param args Array of command arguments
- * @return EXIT_SUCCESS if a built-in command was executed, EXIT_FAILURE
- * otherwise
+ * Makes a batch line wait for an earlier one
+ * @param from Line that has to finish first
+ * @param to Line that waits for it
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
  */
-int execute_builtin_command(char **args)
+int batch_add_dependency(size_t from, size_t to)
 {
-    // Try to execute as exit command
-    if (!execute_exit(args))
-        return EXIT_SUCCESS;
-
-    // Try to execute as cd command
-    if (!execute_cd(args))
-        return EXIT_SUCCESS;
+    struct batch_line *line = &BATCH.lines[from];
 
-    // Try to execute as path command
-    if (!execute_path(args))
+    // Edges are added one line at a time, so a repeated one is always last
+    if (from == to || (line->successor_count > 0 && line->successors[line->successor_count - 1] == to))
+    {
         return EXIT_SUCCESS;
-
-    // Not a built-in command
-    return EXIT_FAILURE;
+    }
+    if (index_list_push(&line->successors, &line->successor_count, &line->successor_capacity, to))
+    {
+        return EXIT_FAILURE;
+    }
+    BATCH.lines[to].waiting_for++;
+    return EXIT_SUCCESS;
 }
 
 /**
- * Constructs a full executable path by combining directory path with command
- * name
- * @param path Directory path to search in
- * @param command Command to execute
- * @return Newly allocated string containing the full path (caller must free)
+ * Finds the name of a batch command, looking past a timeout prefix
+ * @param args NULL-terminated arguments of the command
+ * @return The command's name
  */
-char *create_executable_path(char *path, char *command)
+const char *batch_command_name(char **args)
 {
-    // Allocate memory for the full path (path + / + command + null terminator)
-    char *full_path = malloc(strlen(path) + strlen(command) + 2);
-    if (full_path == NULL)
+    double seconds;
+    if (has_timeout_prefix(args, &seconds))
     {
-        fprintf(ERROUTPUT, ERROR_MSG);
-        exit(EXIT_FAILURE);
+        return args[2];
     }
-    // Construct the full path
-    strcpy(full_path, path);
-    strcat(full_path, "/");
-    strcat(full_path, command);
-    return full_path;
+    return args[0];
 }
 
 /**
- * Handles output redirection in command arguments
- * @param args Array of command arguments
- * @return EXIT_SUCCESS if redirection was handled properly, EXIT_FAILURE otherwise
+ * Checks whether a batch line has to run on its own, after every earlier
+ * line and before every later one
+ * @param line The line to check
+ * @return true if a command of the line is a built-in that changes the
+ * shell's state, or 'parallel' (whose commands are only known once the
+ * items are substituted)
  */
-int handle_redirection(char **args)
+bool batch_line_is_barrier(const struct batch_line *line)
 {
-    int current_position = 0;
-    bool redirection_found = false;
-    char *output_file_path = NULL;
+    static const char *barriers[] = {"cd", "path", "exit", "hash", "jobs-limit", "load-limit", "parallel"};
 
-    // Search through arguments for redirection operator
-    while (args[current_position] != NULL && !redirection_found)
+    for (size_t i = 0; i < line->command_count; i++)
     {
-        // Check if current argument is a redirection symbol
-        if (!strcmp(args[current_position], REDIRECTION_DELIM))
+        for (size_t j = 0; j < sizeof(barriers) / sizeof(barriers[0]); j++)
         {
-            // Error case: redirection at start of command (e.g., "> file")
-            if (current_position == 0)
-            {
-                return EXIT_FAILURE;
-            }
-            
-            // Remove the redirection symbol from arguments
-            args[current_position] = NULL;
-            current_position++;
-            
-            // Get the output file name
-            if (args[current_position] != NULL)
-            {
-                // Store output filename for later use
-                output_file_path = args[current_position];
-                
-                // Remove the filename from arguments
-                args[current_position] = NULL;
-                current_position++;
-                
-                // Error case: multiple redirections (e.g., "ls > file1 > file2")
-                if (args[current_position] != NULL)
-                {
-                    args[current_position] = NULL;
-                    return EXIT_FAILURE;
-                }
-            }
-            else
+            if (!strcmp(batch_command_name(line->commands[i]), barriers[j]))
             {
-                // Error case: missing filename (e.g., "ls >")
-                return EXIT_FAILURE;
+                return true;
             }
-            redirection_found = true;
         }
-        current_position++;
+    }
+    return false;
+}
+
+/**
+ * Records that a batch line names or writes a file, adding the dependencies
+ * this creates
+ * @param files The table of files named since the last barrier
+ * @param name File name as written on the line
+ * @param line_index Index of the line in BATCH
+ * @param is_write Whether the line writes the file (through a redirection)
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ *
+ * Naming a file waits for its last writer; writing it also waits for every
+ * line that named it since, so no line sees the file change underneath it.
+ */
+int batch_record_access(struct file_access_table *files, const char *name, size_t line_index, bool is_write)
+{
+    struct file_access *access = file_access_find(files, name);
+    if (access == NULL)
+    {
+        return EXIT_FAILURE;
     }
 
-    // Perform the actual redirection if an output file was specified
-    if (output_file_path != NULL)
+    if (access->last_writer != SIZE_MAX && batch_add_dependency(access->last_writer, line_index))
     {
-        // Open the output file (create if doesn't exist, truncate if exists)
-        int file_descriptor = open(output_file_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-        if (file_descriptor == -1)
+        return EXIT_FAILURE;
+    }
+
+    if (!is_write)
+    {
+        if (access->reader_count > 0 && access->readers[access->reader_count - 1] == line_index)
         {
-            // Failed to open the output file
-            fprintf(ERROUTPUT, ERROR_MSG);
-            return EXIT_FAILURE;
+            return EXIT_SUCCESS;
         }
-        
-        // Redirect standard output to the file
-        if (dup2(file_descriptor, STDOUT_FILENO) == -1)
+        return index_list_push(&access->readers, &access->reader_count, &access->reader_capacity, line_index);
+    }
+
+    for (size_t i = 0; i < access->reader_count; i++)
+    {
+        if (batch_add_dependency(access->readers[i], line_index))
         {
-            // Failed to redirect stdout
-            close(file_descriptor);
-            fprintf(ERROUTPUT, ERROR_MSG);
             return EXIT_FAILURE;
         }
-        
-        // Close the file descriptor as it's now duplicated to stdout
-        close(file_descriptor);
     }
-
+    access->reader_count = 0;
+    access->last_writer = line_index;
     return EXIT_SUCCESS;
 }
 
 /**
- * Executes a command using fork and execv
- * @param args Array of arguments for the command
- * @param process_id Pointer to store the process ID (for parallel execution)
- * @return EXIT_SUCCESS on success, EXIT_FAILURE on failure
+ * Adds the dependencies of a batch line on the files it names and writes
+ * @param files The table of files named since the last barrier
+ * @param line_index Index of the line in BATCH
+ * @return EXIT_SUCCESS on success, EXIT_FAILURE if memory couldn't be allocated
+ *
+ * The targets of '>', '>>', '2>', '&>' and the like are writes; every other
+ * word, including the command name and '<' targets, is a file the line may
+ * read. Reads are recorded before writes so "sort data > data" waits for
+ * both the earlier writers and readers of data.
  */
-int execute_command(char **args, pid_t *process_id)
+int batch_analyse_line(struct file_access_table *files, size_t line_index)
 {
-    // First try to handle as a built-in command (cd, exit, path)
-    if (!execute_builtin_command(args))
-    {
-        // If it's a built-in command, execute it and return success
-        // No need to track process ID for built-in commands
-        return EXIT_SUCCESS;
-    }
-
-    // Create a child process to execute the external command
-    pid_t child_pid = fork();
+    struct batch_line *line = &BATCH.lines[line_index];
 
-    // Handle possible fork outcomes
-    if (child_pid == -1)
-    {
-        // Fork failed - system couldn't create a new process
-        fprintf(ERROUTPUT, ERROR_MSG);
-        return EXIT_FAILURE;
-    }
-    else if (child_pid == 0)
+    for (int pass = 0; pass < 2; pass++)
     {
-        // Child process code path
-        int path_count = 0;
-        char *executable_path;
-        
-        // Handle any redirection in the child process 
-        // (important to do this in the child so it doesn't affect the parent)
-        bool redirection_success = !handle_redirection(args);
-
-        // If redirection succeeded, search for the command in PATH directories
-        while (redirection_success && PATH[path_count] != NULL)
+        bool writes = pass == 1;
+        for (size_t i = 0; i < line->command_count; i++)
         {
-            // Construct the full path for the executable
-            executable_path = create_executable_path(PATH[path_count], args[0]);
+            char **args = line->commands[i];
+            for (size_t j = 0; args[j] != NULL; j++)
+            {
+                const char *name = args[j];
+                bool is_write = false;
 
-            // Try to execute the command
-            execv(executable_path, args);
-            
-            // If execv returns, the command wasn't found in this path directory
-            free(executable_path);
-            path_count++;
-        }
+                if (!strcmp(args[j], PIPE_DELIM))
+                {
+                    continue;
+                }
+                if (is_redirection_operator(args[j]))
+                {
+                    // 'N>&M' names no file
+                    if (strstr(args[j], REDIRECTION_DELIM PARALLEL_DELIM) != NULL || args[j + 1] == NULL)
+                    {
+                        continue;
+                    }
+                    is_write = strchr(args[j], REDIRECTION_DELIM[0]) != NULL;
+                    name = args[++j];
+                }
 
-        // If we reach here, command wasn't found in any path directory
-        fprintf(ERROUTPUT, ERROR_MSG);
-        exit(EXIT_FAILURE); // Exit child process on failure
-    }
-    else
-    {
-        // Parent process code path
-        // Save child process PID for later waitpid call in parallel execution
-        *process_id = child_pid;
-        return EXIT_SUCCESS;
+                if (is_write == writes && batch_record_access(files, name, line_index, is_write))
+                {
+                    return EXIT_FAILURE;
+                }
+            }
+        }
     }
+    return EXIT_SUCCESS;
 }
 
 /**
- * Parses tokens for special delimiters and handles complex token embedding
- * @param tokens Array of initial tokens
- * @param token_count Pointer to the number of tokens in the array (will be updated)
- * @param delimiter The delimiter to look for ('>' for redirection or '&' for parallel)
- * @return Processed array of tokens with proper delimiter handling
+ * Runs a whole batch file, starting each line as soon as the lines it
+ * depends on have finished (--parallel-batch)
  *
- * This function analyzes each token to detect special operators:
- * - If a token matches the delimiter exactly, it's preserved as is
- * - If a token contains the delimiter embedded (like "echo>file" or "cmd&cmd2"),
- *   it splits the token into separate parts with the delimiter in between
+ * All lines are read and parsed first. A line depends on an earlier one
+ * when one of them writes a file the other names; lines with state-changing
+ * built-ins are barriers. Lines whose dependencies have finished are queued
+ * for the scheduler, so independent lines run concurrently under JOBS_LIMIT.
  */
-char **parse_subtokens(char **tokens, int *token_count, char *delimiter)
+void run_parallel_batch()
 {
-    char **parsed_tokens = malloc(TOKENS_NUMBER * (sizeof(char *)));
-    int parsed_count = 0; // tracks the number of tokens found
+    char *line = NULL;
+    size_t buffer_size = 0;
+    ssize_t length;
+    struct file_access_table files = {NULL, 0, 0};
+    size_t last_barrier = SIZE_MAX; // Latest barrier line, if any
+    size_t barrier_start = 0;       // First line the next barrier waits for
+    bool failed = false;
 
-    char *subtoken;
+    arena_reset(&LINE_ARENA);
+    BATCH.lines = NULL;
+    BATCH.count = 0;
+    BATCH.capacity = 0;
 
-    for (int i = 0; i < *token_count; i++)
+    // Each read is timed from the moment the previous line was handled
+    struct timespec start;
+    while (!failed && (start = trace_clock(), length = getline(&line, &buffer_size, INPUT)) != -1)
     {
-        // Check if the token is exactly the delimiter
-        if (!strcmp(tokens[i], delimiter))
+        trace_span("read line", "shell", start, TRACE.pid, NULL);
+        // Every line stays parsed until the whole batch has run
+        char *copy = arena_alloc(&LINE_ARENA, length + 1);
+        if (copy == NULL)
         {
-            parsed_tokens[parsed_count++] = tokens[i];
-            parsed_tokens[parsed_count] = NULL;
-            continue;
+            failed = true;
+            break;
         }
-        
-        // Make a copy to compare with after tokenization
-        char *token_copy = malloc(strlen(tokens[i]) + 1);
-        strcpy(token_copy, tokens[i]);
-
-        // Try to split by the delimiter
-        subtoken = strtok(tokens[i], delimiter);
+        memcpy(copy, line, length + 1);
 
-        // If token wasn't split, keep it as is
-        if (!strcmp(subtoken, token_copy))
+        start = trace_clock();
+        char **args = parse_line(copy);
+        trace_span("parse", "shell", start, TRACE.pid, NULL);
+        size_t command_count;
+        char ***commands = args != NULL && args[0] != NULL ? split_commands(args, &command_count) : NULL;
+        if (commands == NULL || command_count == 0)
         {
-            parsed_tokens[parsed_count++] = tokens[i];
-            parsed_tokens[parsed_count] = NULL;
-            free(token_copy);
             continue;
         }
+        STATS.lines++;
 
-        free(token_copy);
+        if (BATCH.count == BATCH.capacity)
+        {
+            size_t new_capacity = BATCH.capacity ? BATCH.capacity * 2 : JOB_TABLE_INITIAL_CAPACITY;
+            struct batch_line *new_lines = arena_grow(&LINE_ARENA, BATCH.lines, BATCH.capacity * sizeof(*new_lines),
+                                                      new_capacity * sizeof(*new_lines));
+            if (new_lines == NULL)
+            {
+                failed = true;
+                break;
+            }
+            BATCH.lines = new_lines;
+            BATCH.capacity = new_capacity;
+        }
 
-        // Handle the split token parts
-        do
+        size_t line_index = BATCH.count++;
+        struct batch_line *current = &BATCH.lines[line_index];
+        memset(current, 0, sizeof(*current));
+        current->commands = commands;
+        current->command_count = command_count;
+
+        if (batch_line_is_barrier(current))
+        {
+            // Wait for everything since the previous barrier; later lines
+            // wait for this one, so earlier file accesses no longer matter
+            for (size_t i = barrier_start; i < line_index && !failed; i++)
+            {
+                failed = batch_add_dependency(i, line_index);
+            }
+            barrier_start = line_index;
+            last_barrier = line_index;
+            if (files.slots != NULL)
+            {
+                memset(files.slots, 0, files.capacity * sizeof(*files.slots));
+                files.count = 0;
+            }
+        }
+        else
         {
-            parsed_tokens[parsed_count++] = subtoken;
-            parsed_tokens[parsed_count++] = delimiter; // Insert delimiter as a separate token
-            subtoken = strtok(NULL, delimiter); // Get next part
-        } while (subtoken != NULL);
-        
-        // Remove the last NULL that was assigned
-        parsed_tokens[--parsed_count] = NULL;
+            failed = (last_barrier != SIZE_MAX && batch_add_dependency(last_barrier, line_index)) ||
+                     batch_analyse_line(&files, line_index);
+        }
     }
-    
-    // Update the token count to reflect the new total
-    *token_count = parsed_count;
-    return parsed_tokens;
-}
-
-/**
- * Parses a command line into an array of tokens (words)
- * @param line The input command line to parse
- * @return Array of string tokens (needs to be freed by caller)
- */
-char **parse_line(char *line)
-{
-    // Allocate space for tokens array (maximum TOKENS_NUMBER tokens)
-    char **initial_tokens = malloc(TOKENS_NUMBER * (sizeof(char *)));
-    int token_count = 0; // Tracks the number of tokens found
+    free(line);
 
-    // Check if memory allocation succeeded
-    if (!initial_tokens)
+    if (failed)
     {
+        // Running only part of the batch could break its dependencies
         fprintf(ERROUTPUT, ERROR_MSG);
-        return NULL;
+        arena_release(&LINE_ARENA);
+        return;
     }
 
-    // Split the line into tokens using basic whitespace delimiters
-    char *token = strtok(line, DELIM);
-    while (token != NULL && token_count < TOKENS_NUMBER - 1)
+    // Start with every line that waits for nothing
+    for (size_t i = 0; i < BATCH.count; i++)
     {
-        initial_tokens[token_count++] = token;
-        token = strtok(NULL, DELIM);
+        if (BATCH.lines[i].waiting_for == 0)
+        {
+            batch_line_ready(i);
+        }
     }
+    run_jobs();
 
-    // Null-terminate the array of tokens for easier processing
-    initial_tokens[token_count] = NULL;
-
-    // Process the special operators in two steps:
-    
-    // Step 1: Parse and handle redirection operator ('>')
-    char **redirection_parsed = parse_subtokens(initial_tokens, &token_count, REDIRECTION_DELIM);
-    
-    // Step 2: Parse and handle parallel execution operator ('&')
-    char **final_tokens = parse_subtokens(redirection_parsed, &token_count, PARALLEL_DELIM);
-    
-    // Free the intermediate array
-    free(initial_tokens);
-    
-    return final_tokens;
+    arena_release(&LINE_ARENA);
 }
 
 /**
@@ -457,13 +6313,22 @@ char **parse_line(char *line)
  */
 void wish_shell()
 {
+    // A batch file can be analysed as a whole and run out of order
+    if (PARALLEL_BATCH && INPUT != stdin)
+    {
+        run_parallel_batch();
+        return;
+    }
+
+    // The getline buffer is kept from line to line and only grows when a
+    // longer line arrives
     char *line = NULL;
     size_t buffer_size = 0;
 
     while (SHELL_RUNNING)
     {
-        line = NULL;
-        buffer_size = 0;
+        // Everything allocated for the previous line is released at once
+        arena_reset(&LINE_ARENA);
 
         // Print shell prompt in interactive mode only (when input is from terminal)
         if (INPUT == stdin)
@@ -473,93 +6338,47 @@ void wish_shell()
         }
 
         // Get input line from user using getline for dynamic allocation
+        struct timespec start = trace_clock();
         if (getline(&line, &buffer_size, INPUT) == -1)
         {
             // Handle EOF (Ctrl+D) or read error by exiting the loop
-            free(line);
             break;
         }
+        trace_span("read line", "shell", start, TRACE.pid, NULL);
+        struct timespec read_at;
+        clock_gettime(CLOCK_MONOTONIC, &read_at);
 
         // Parse input line into array of command arguments
+        start = trace_clock();
         char **args = parse_line(line);
+        trace_span("parse", "shell", start, TRACE.pid, NULL);
 
         // Skip empty commands or commands that failed to parse
         if (args == NULL || args[0] == NULL)
         {
-            free(args);
-            free(line);
             continue;
         }
 
-        // Arrays and counters for parallel command execution
-        pid_t parallel_processes[MAX_PARALLEL_PROCESSES]; // Array to store process IDs
-        int process_count = 0;                            // Counter for parallel processes
-        int arg_position = 0;                             // Current position in args array
-        int command_arg_count = 0;                        // Counter for current command's arguments
-        
-        // Temporary array to hold the current command to be executed
-        char **current_command = malloc(sizeof(char *) * TOKENS_NUMBER);
-
-        // Process all arguments, creating commands separated by PARALLEL_DELIM ('&')
-        while (args[arg_position] != NULL)
-        {
-            // Copy current argument to the command array
-            current_command[command_arg_count] = malloc(strlen(args[arg_position]) + 1);
-            strcpy(current_command[command_arg_count], args[arg_position]);
-            current_command[command_arg_count + 1] = NULL;
-            
-            // Check if the current argument is a parallel delimiter ('&')
-            if (!strcmp(args[arg_position], PARALLEL_DELIM))
-            {
-                // Handle empty command before delimiter
-                if (!command_arg_count)
-                {
-                    break;
-                }
-                
-                // Null-terminate the current command
-                current_command[command_arg_count] = NULL;
-                
-                // Execute the command and store its process ID
-                execute_command(current_command, &parallel_processes[process_count++]);
-                
-                // Free the memory for the delimiter token
-                free(current_command[command_arg_count]);
-                
-                // Reset command argument counter to prepare for next command
-                command_arg_count = -1;
-            }
-            
-            // Move to the next argument
-            arg_position++;
-            command_arg_count++;
-        }
-        
-        // Execute the last command if there are any pending arguments
-        if (command_arg_count)
-        {
-            execute_command(current_command, &parallel_processes[process_count++]);
-        }
-
-        // Free the allocated memory for current_command
-        for (int i = 0; i < command_arg_count; i++)
+        // Queue each '&'-separated command as a job
+        size_t command_count;
+        char ***commands = split_commands(args, &command_count);
+        for (size_t i = 0; commands != NULL && i < command_count; i++)
         {
-            free(current_command[i]);
+            if (job_table_add(commands[i]))
+            {
+                fprintf(ERROUTPUT, ERROR_MSG);
+            }
         }
-        free(current_command);
 
-        // Wait for all processes to complete
-        int status;
-        for (int i = 0; i < process_count; ++i)
-        {
-            // Wait for each child process to complete
-            waitpid(parallel_processes[i], &status, 0);
-        }
-        
-        // Free allocated memory to prevent leaks
-        free(args);
-        free(line);
+        // Run the queued commands and wait for all processes to complete
+        run_jobs();
+        STATS.lines++;
+        histogram_record_since(&STATS.dispatch, &read_at);
     }
+
+    // Free allocated memory to prevent leaks
+    free(line);
+    arena_release(&LINE_ARENA);
 }
 
 /**
@@ -615,6 +6434,196 @@ void handle_shell_redirection(int argc, char **argv)
     }
 }
 
+/**
+ * Parses the shell's command-line options
+ * @param argc Number of command-line arguments
+ * @param argv Array of command-line arguments
+ * @return Index in argv of the first non-option argument
+ *
+ * Supported options:
+ * - --launcher=fork|spawn: Select how external commands are started
+ * - --path-index=FILE: Share executable lookups through an index file
+ *   (defaults to the WISH_PATH_INDEX environment variable)
+ * - -j N, --jobs=N: Run at most N '&'-separated commands at once (0: no
+ *   limit, default: number of online CPUs)
+ * - --group-output: Print each command's output in one piece when it ends
+ * - --tag[=number|command]: Print output line by line, prefixed with the
+ *   command's position in the line or its name
+ * - --parallel-batch: Run independent batch lines at the same time
+ * - -l LOAD, --max-load=LOAD, --max-cpu-pressure=PCT,
+ *   --max-memory-pressure=PCT: Hold back new parallel commands under load
+ * - --affinity=compact|scatter|round-robin: Pin parallel commands to CPUs
+ * - --numa: Pin parallel commands to NUMA nodes instead of single CPUs
+ * - --job-timeout=DURATION: Time limit for commands without their own
+ * - --usage-report=FD: Write each command's resource usage to FD
+ * - --trace=FILE: Write a Chrome trace-event timeline to FILE
+ * - --stats-on-exit: Print the counters and latency percentiles on exit
+ */
+int parse_shell_options(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        {"launcher", required_argument, NULL, 'L'},
+        {"path-index", required_argument, NULL, 'I'},
+        {"jobs", required_argument, NULL, 'j'},
+        {"group-output", no_argument, NULL, 'G'},
+        {"tag", optional_argument, NULL, 'T'},
+        {"parallel-batch", no_argument, NULL, 'B'},
+        {"max-load", required_argument, NULL, 'l'},
+        {"max-cpu-pressure", required_argument, NULL, 'C'},
+        {"max-memory-pressure", required_argument, NULL, 'M'},
+        {"affinity", required_argument, NULL, 'A'},
+        {"numa", no_argument, NULL, 'N'},
+        {"job-timeout", required_argument, NULL, 'O'},
+        {"usage-report", required_argument, NULL, 'U'},
+        {"trace", required_argument, NULL, 'R'},
+        {"stats-on-exit", no_argument, NULL, 'S'},
+        {NULL, 0, NULL, 0},
+    };
+    int option;
+
+    opterr = 0; // Report problems with the standard error message instead
+
+    // Run one job per online CPU unless told otherwise
+    long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    JOBS_LIMIT = online_cpus > 0 ? (size_t)online_cpus : 0;
+
+    // The index file can also be shared through the environment
+    char *index_file_path = getenv("WISH_PATH_INDEX");
+    if (index_file_path != NULL && index_file_path[0] != '\0')
+    {
+        PATH_INDEX.file_path = strdup(index_file_path);
+    }
+
+    // '+' stops at the first non-option so batch file names are left alone
+    while ((option = getopt_long(argc, argv, "+j:l:", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'L':
+            if (!strcmp(optarg, "fork"))
+            {
+                LAUNCHER = LAUNCHER_FORK;
+            }
+            else if (!strcmp(optarg, "spawn"))
+            {
+                LAUNCHER = LAUNCHER_SPAWN;
+            }
+            else
+            {
+                fprintf(stderr, ERROR_MSG);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'I':
+            free(PATH_INDEX.file_path);
+            PATH_INDEX.file_path = strdup(optarg);
+            break;
+        case 'j':
+            if (parse_jobs_limit(optarg, &JOBS_LIMIT))
+            {
+                fprintf(stderr, ERROR_MSG);
+                exit(EXIT_FAILURE);
+            }
+            JOBS_LIMIT_GIVEN = true;
+            break;
+        case 'G':
+            OUTPUT_MODE = OUTPUT_GROUP;
+            break;
+        case 'B':
+            PARALLEL_BATCH = true;
+            break;
+        case 'l':
+        case 'C':
+        case 'M':
+        {
+            double *limit = option == 'l' ? &LOAD.max_load
+                            : option == 'C' ? &LOAD.max_cpu_pressure
+                                            : &LOAD.max_memory_pressure;
+            if (parse_load_limit(optarg, limit))
+            {
+                fprintf(stderr, ERROR_MSG);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case 'A':
+            if (!strcmp(optarg, "compact"))
+            {
+                AFFINITY.policy = AFFINITY_COMPACT;
+            }
+            else if (!strcmp(optarg, "scatter"))
+            {
+                AFFINITY.policy = AFFINITY_SCATTER;
+            }
+            else if (!strcmp(optarg, "round-robin"))
+            {
+                AFFINITY.policy = AFFINITY_ROUND_ROBIN;
+            }
+            else
+            {
+                fprintf(stderr, ERROR_MSG);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'N':
+            AFFINITY.numa = true;
+            break;
+        case 'U':
+        {
+            // The descriptor is inherited from whoever started the shell
+            char *end;
+            long report_fd = strtol(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || report_fd < 0 || report_fd > INT_MAX ||
+                fcntl((int)report_fd, F_GETFD) == -1)
+            {
+                fprintf(stderr, ERROR_MSG);
+                exit(EXIT_FAILURE);
+            }
+            USAGE_REPORT_FD = (int)report_fd;
+            break;
+        }
+        case 'S':
+            STATS_ON_EXIT = true;
+            break;
+        case 'R':
+            if (TRACE.fd != -1 || trace_open(optarg))
+            {
+                fprintf(stderr, ERROR_MSG);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'O':
+            if (parse_duration(optarg, &JOB_TIMEOUT))
+            {
+                fprintf(stderr, ERROR_MSG);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            OUTPUT_MODE = OUTPUT_TAG;
+            if (optarg == NULL || !strcmp(optarg, "number"))
+            {
+                TAG_SOURCE = TAG_JOB_NUMBER;
+            }
+            else if (!strcmp(optarg, "command"))
+            {
+                TAG_SOURCE = TAG_COMMAND_NAME;
+            }
+            else
+            {
+                fprintf(stderr, ERROR_MSG);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            // Unknown option or missing option argument
+            fprintf(stderr, ERROR_MSG);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return optind;
+}
+
 /**
  * Closes any opened file streams before program termination
  * This function ensures proper cleanup of file resources
@@ -632,12 +6641,47 @@ void close_streams()
 
 int main(int argc, char *argv[])
 {
+    // Consume options; the remaining arguments are shifted so that the batch
+    // file (if any) is seen at index 1 by handle_shell_redirection()
+    int first_argument = parse_shell_options(argc, argv);
+
     // Handle input and output redirection based on command-line arguments
-    handle_shell_redirection(argc, argv);
+    handle_shell_redirection(argc - first_argument + 1, argv + first_argument - 1);
 
     // Initialize default path directories
     initialize_path();
 
+    // Watch the PATH directories so cached lookups stay correct
+    path_watcher_reset();
+
+    // Prepare to reap children in the order they finish
+    event_loop_init();
+
+    // --job-timeout relies on the event loop's timers
+    if (JOB_TIMEOUT > 0 && EVENTS.epoll_fd == -1)
+    {
+        fprintf(stderr, ERROR_MSG);
+        exit(EXIT_FAILURE);
+    }
+
+    // Share job slots with make, as a client or for sub-makes
+    jobserver_init();
+
+    // Work out where --affinity pins jobs
+    affinity_init();
+
+    // Report the statistics however the shell ends
+    if (STATS_ON_EXIT)
+    {
+        atexit(print_stats_on_exit);
+    }
+
+    // Map the shared PATH index now; it is validated on the first lookup
+    if (PATH_INDEX.file_path != NULL)
+    {
+        path_index_map();
+    }
+
     // Start the shell with configured input/output
     wish_shell();
 